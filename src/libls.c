@@ -0,0 +1,3292 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/limits.h>   // for PATH_MAX
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "libls.h"
+#include "ls_stats.h"
+
+/* ---------- Built-in colors (LS_COLORS syntax) ----------
+ * Type colors are used unless LS_COLORS overrides them; the extension
+ * colors only when LS_COLORS is not set at all, as with GNU ls.
+ */
+#define BUILTIN_TYPE_COLORS "no=0:di=1;34:ln=1;35:pi=7:so=7:bd=7:cd=7:ex=1;32"
+#define BUILTIN_EXT_COLORS  "*.tar=1;31:*.gz=1;31:*.zip=1;31"
+
+/* ---------- Entries ----------
+ * ls_entry_t from libls.h; names and link targets live in the arena of
+ * the listing they belong to.
+ */
+typedef ls_entry_t entry_t;
+
+/* ---------- Color classes ----------
+ * A color index is one of these, or CLR_COUNT and up for the distinct
+ * colors of extension patterns (see the color database).
+ */
+enum color_class {
+    CLR_PLAIN,      /* no */
+    CLR_FILE,       /* fi */
+    CLR_DIR,        /* di */
+    CLR_LINK,       /* ln */
+    CLR_FIFO,       /* pi */
+    CLR_SOCK,       /* so */
+    CLR_BLK,        /* bd */
+    CLR_CHR,        /* cd */
+    CLR_EXEC,       /* ex */
+    CLR_SETUID,     /* su */
+    CLR_SETGID,     /* sg */
+    CLR_STICKY_OW,  /* tw */
+    CLR_OTHER_W,    /* ow */
+    CLR_STICKY,     /* st */
+    CLR_COUNT
+};
+#define CLR_MAX 256
+
+/* ---------- Color database (LS_COLORS) ----------
+ * Parsed by ls_colors_load(). Every color is rendered up front into its
+ * complete escape sequence, so printing a name is three memcpy()s.
+ * Suffix patterns ("*.tar.gz") are kept in an open-addressing table
+ * keyed by the text after their last '.', which is what the name scan
+ * already found for each entry; patterns sharing a key are chained
+ * longest first. Matching ignores ASCII case, like GNU ls.
+ */
+typedef struct {
+    char *seq;
+    size_t len;
+} color_seq_t;
+
+typedef struct {
+    char *text;             /* lowercased suffix, e.g. ".tar.gz" */
+    size_t len;
+    unsigned next;          /* 1 + index of the next pattern with this key */
+    unsigned char color;
+} color_suffix_t;
+
+typedef struct {
+    uint32_t hash;
+    unsigned first;         /* 1 + index into suffixes; 0 = free slot */
+    const char *key;        /* text after the last '.', inside the pattern */
+    size_t key_len;
+} color_bucket_t;
+
+static struct {
+    color_seq_t seqs[CLR_MAX];          /* by color index */
+    unsigned nseqs;
+    unsigned char set[CLR_COUNT];       /* class has a color of its own */
+    color_seq_t reset;                  /* written after each name */
+    color_bucket_t *buckets;
+    size_t nbuckets, nkeys;             /* nbuckets is a power of two */
+    color_suffix_t *suffixes;
+    size_t nsuffixes, suffix_cap;
+    unsigned tails;                     /* 1 + first pattern with no '.' */
+    int dir_modes;                      /* tw/ow/st: directories need a mode */
+    uint32_t sig;                       /* identifies the config for --cache */
+} colors;
+
+/* ---------- Metadata levels ----------
+ * How much read_dir_entries() has to learn about each entry; these are
+ * the LS_FIELD_* values.
+ *   META_COLOR:   file type plus the executable bits (name-only modes);
+ *                 d_type is trusted for everything except regular files.
+ *   META_FULL:    lstat() plus symlink targets (-l).
+ *   META_SORTKEY: size and mtime of every entry, for -t/-S.
+ *   META_ALLSTAT: with META_FULL, st_ino and st_blocks too (--format).
+ * They are flags that can be combined; statx() is asked for no more.
+ */
+enum {
+    META_COLOR = LS_FIELD_TYPE, META_FULL = LS_FIELD_STAT, META_SORTKEY = LS_FIELD_SORTKEY,
+    META_ALLSTAT = LS_FIELD_ALLSTAT
+};
+
+/* ---------- Sort keys ---------- */
+enum { SORT_NAME = LS_SORT_NAME, SORT_TIME = LS_SORT_TIME, SORT_SIZE = LS_SORT_SIZE,
+       SORT_EXT = LS_SORT_EXT };
+
+/* ---------- Run-wide options ----------
+ * The ls_options_t of the call in progress, unpacked (options_set()).
+ */
+typedef struct {
+    int meta;           /* META_*: what to fetch for each entry */
+    int dont_sync;      /* accept cached attributes (statx) */
+    size_t dirbuf_size; /* raw getdents64 buffer, 0 = readdir() */
+    int jobs;           /* reader threads for recursive walks */
+    int stat_jobs;      /* stat threads per huge directory */
+    int io_uring;       /* batch statx through io_uring if built in */
+    int uring_depth;    /* requests in flight per ring */
+    int unsorted;       /* LS_SORT_NONE: stream entries in directory order */
+    int all;            /* include names starting with '.' */
+    int sort_key;       /* SORT_*: name by default */
+    int reverse;
+    size_t head;        /* only the first K entries */
+    int recursive;      /* ls_walk() descends into subdirectories */
+    int color;          /* classify entries for the color database */
+    int follow;         /* stat link targets; descend into linked directories */
+    int one_fs;         /* recursive walks stay on each path's device */
+    void (*on_error)(const char *msg, void *arg);
+    void *error_arg;
+} options_t;
+
+static options_t opts = { .uring_depth = 64 };
+
+/* ---------- Bump arena (per-directory string storage) ----------
+ * Names and link targets for one directory are packed into large chunks
+ * and released together with a single arena_free().
+ */
+#define ARENA_CHUNK 65536
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, size;
+    char data[];
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *head;
+} arena_t;
+
+/* ---------- One loaded directory ---------- */
+typedef struct {
+    DIR *dirp;          /* kept open so children can be opened relative to it */
+    entry_t *ents;
+    size_t count;
+    arena_t arena;
+    int cached;         /* entries came from the --cache/--since file */
+} dir_listing_t;
+
+/* ---------- Growable text buffer ---------- */
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} strbuf_t;
+
+/* ---------- PROTOTYPES ---------- */
+static void list_dir(int parent_fd, const char *name, const char *path);
+static char *join_path(const char *parent, const char *child);
+static int walk_release_fds(void);
+static int node_release_fds(void);
+static void sort_entries(entry_t *arr, size_t n);
+static unsigned char classify_color(const entry_t *e);
+static int load_dir(int parent_fd, const char *name, const char *path, dir_listing_t *d);
+static void free_dir(dir_listing_t *d);
+static int load_dir_topk(const char *path, int meta, dir_listing_t *d);
+static void list_trees_parallel(const char *const *paths, size_t npaths);
+static DIR *open_dir_at(int parent_fd, const char *name, const char *path);
+static int fetch_stat(int dfd, const char *name, int meta, struct stat *st);
+static int fetch_stat_raw(int dfd, const char *name, int meta, int flags, struct stat *st);
+static entry_t *read_dir_entries(DIR *dirp, const char *path, int meta,
+                                 size_t *out_count, arena_t *arena);
+static entry_t *read_dir_entries_raw(DIR *dirp, const char *path, int meta,
+                                     size_t *out_count, arena_t *arena);
+
+/* ---------- Arena helpers ---------- */
+static void arena_init(arena_t *a) {
+    a->head = NULL;
+}
+
+static char *arena_alloc(arena_t *a, size_t n) {
+    arena_chunk_t *c = a->head;
+    if (!c || c->size - c->used < n) {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        c = malloc(sizeof(arena_chunk_t) + size);
+        if (!c) return NULL;
+        c->next = a->head;
+        c->used = 0;
+        c->size = size;
+        a->head = c;
+    }
+    char *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+static char *arena_strndup(arena_t *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* Keeps the newest chunk for reuse and releases the rest. */
+static void arena_reset(arena_t *a) {
+    arena_chunk_t *c = a->head;
+    if (!c) return;
+    arena_chunk_t *rest = c->next;
+    c->next = NULL;
+    c->used = 0;
+    while (rest) {
+        arena_chunk_t *next = rest->next;
+        free(rest);
+        rest = next;
+    }
+}
+
+static void arena_free(arena_t *a) {
+    arena_chunk_t *c = a->head;
+    while (c) {
+        arena_chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
+
+/* ---------- strbuf helpers ---------- */
+/* Appends one formatted message, NUL included, so a buffer holds a
+ * sequence of C strings. Returns -1 if it did not fit in memory. */
+static int strbuf_vappendf(strbuf_t *sb, const char *fmt, va_list ap) {
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(NULL, 0, fmt, aq);
+    va_end(aq);
+    if (n < 0) return -1;
+    if (sb->len + (size_t)n + 1 > sb->cap) {
+        size_t ncap = sb->cap ? sb->cap : 128;
+        while (ncap < sb->len + (size_t)n + 1) ncap *= 2;
+        char *nb = realloc(sb->buf, ncap);
+        if (!nb) return -1;
+        sb->buf = nb;
+        sb->cap = ncap;
+    }
+    vsnprintf(sb->buf + sb->len, sb->cap - sb->len, fmt, ap);
+    sb->len += (size_t)n + 1;
+    return 0;
+}
+
+static void strbuf_free(strbuf_t *sb) {
+    free(sb->buf);
+    sb->buf = NULL;
+    sb->len = sb->cap = 0;
+}
+
+#ifndef LS_NO_STATS
+struct ls_stats ls_stats;
+#endif
+
+/* ---------- Errors ----------
+ * Messages go to the caller's on_error (stderr by default). Reader
+ * threads set warn_sink so their messages are held back and replayed by
+ * the printer in order. errno is left as it was.
+ */
+static _Thread_local strbuf_t *warn_sink;
+
+static void report_error(const char *msg) {
+    if (opts.on_error)
+        opts.on_error(msg, opts.error_arg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+/* Hands the messages buffered in sb to report_error(). */
+static void replay_errors(const strbuf_t *sb) {
+    for (size_t off = 0; off < sb->len; off += strlen(sb->buf + off) + 1)
+        report_error(sb->buf + off);
+}
+
+__attribute__((format(printf, 1, 2)))
+static void warn_fmt(const char *fmt, ...) {
+    int saved = errno;
+    va_list ap;
+    va_start(ap, fmt);
+    if (warn_sink) {
+        strbuf_vappendf(warn_sink, fmt, ap);
+    } else {
+        strbuf_t sb = { NULL, 0, 0 };
+        if (strbuf_vappendf(&sb, fmt, ap) == 0) report_error(sb.buf);
+        strbuf_free(&sb);
+    }
+    va_end(ap);
+    errno = saved;
+}
+
+static void warn(const char *what) {
+    warn_fmt("%s: %s", what, strerror(errno));
+}
+
+static void warn_at(const char *path, const char *name) {
+    warn_fmt("%s/%s: %s", path, name, strerror(errno));
+}
+
+/* ---------- Helper: open a directory relative to its parent ----------
+ * parent_fd is AT_FDCWD for command-line paths and the parent's dirfd()
+ * while recursing, so each lookup only resolves a single component.
+ * If we run out of descriptors, the -R walk gives up the ones its outer
+ * frames hold (they are reopened later) and we retry.
+ */
+static DIR *open_dir_at(int parent_fd, const char *name, const char *path) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STATS_COUNT(CTR_SYS_OPEN, 1);
+    if (fd == -1 && errno == EMFILE && walk_release_fds()) {
+        fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        STATS_COUNT(CTR_SYS_OPEN, 1);
+    }
+    if (fd == -1) {
+        warn(path);
+        return NULL;
+    }
+    DIR *dirp = fdopendir(fd);
+    if (!dirp) {
+        warn(path);
+        close(fd);
+    }
+    return dirp;
+}
+
+/* ---------- Helper: per-entry metadata ----------
+ * Where statx() exists we ask only for the fields the current mode
+ * prints, so network filesystems can skip revalidating the rest;
+ * --dont-sync additionally lets them answer from cached attributes.
+ * Kernels without statx fall back to fstatat() for the rest of the run.
+ */
+#ifdef STATX_TYPE
+static atomic_int statx_unavailable;
+
+static unsigned int statx_mask_for(int meta) {
+    unsigned int mask = STATX_TYPE | STATX_MODE;
+    if (meta & META_FULL)
+        mask |= STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+    if (meta & META_SORTKEY)
+        mask |= STATX_SIZE | STATX_MTIME;
+    if (meta & META_ALLSTAT)
+        mask |= STATX_BASIC_STATS;
+    if (opts.follow)
+        mask |= STATX_INO;      /* the -L visited set */
+    return mask;
+}
+
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev   = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_rdev  = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_ino   = sx->stx_ino;
+    st->st_mode  = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid   = sx->stx_uid;
+    st->st_gid   = sx->stx_gid;
+    st->st_size  = (off_t)sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks  = (blkcnt_t)sx->stx_blocks;
+    st->st_atim.tv_sec  = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec  = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec  = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+#endif
+
+/* Under -L links are followed; a dangling or looping one is shown as
+ * the link itself. */
+static int fetch_stat(int dfd, const char *name, int meta, struct stat *st) {
+    STATS_START(t0);
+    int rc = fetch_stat_raw(dfd, name, meta, opts.follow ? 0 : AT_SYMLINK_NOFOLLOW, st);
+    if (rc == -1 && opts.follow && (errno == ENOENT || errno == ELOOP))
+        rc = fetch_stat_raw(dfd, name, meta, AT_SYMLINK_NOFOLLOW, st);
+    STATS_STOP(PH_STAT, t0);
+    STATS_COUNT(CTR_SYS_STAT, 1);
+    return rc;
+}
+
+static int fetch_stat_raw(int dfd, const char *name, int meta, int flags, struct stat *st) {
+#ifdef STATX_TYPE
+    if (!atomic_load_explicit(&statx_unavailable, memory_order_relaxed)) {
+        struct statx sx;
+        int sx_flags = flags;
+        if (opts.dont_sync) sx_flags |= AT_STATX_DONT_SYNC;
+        if (statx(dfd, name, sx_flags, statx_mask_for(meta), &sx) == 0) {
+            statx_to_stat(&sx, st);
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        atomic_store_explicit(&statx_unavailable, 1, memory_order_relaxed);
+    }
+#else
+    (void)meta;
+#endif
+    return fstatat(dfd, name, st, flags);
+}
+
+/* ---------- Name scan ----------
+ * Every name read is scanned exactly once, finding its length, its last
+ * '.' (for -X and archive colors) and whether it is hidden together,
+ * 32 (AVX2, `make AVX2=1`) or 16 (SSE2) bytes at a time, bytewise
+ * elsewhere. Loads are aligned, so although they read past the NUL they
+ * never cross into another page; bytes before the name are masked off.
+ * That is outside what ASan allows, hence the attribute.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 32
+typedef __m256i scan_vec_t;
+#define SCAN_SPLAT(c)   _mm256_set1_epi8(c)
+#define SCAN_LOAD(p)    _mm256_load_si256((const __m256i *)(const void *)(p))
+#define SCAN_MATCH(v, c) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c)))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+typedef __m128i scan_vec_t;
+#define SCAN_SPLAT(c)   _mm_set1_epi8(c)
+#define SCAN_LOAD(p)    _mm_load_si128((const __m128i *)(const void *)(p))
+#define SCAN_MATCH(v, c) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c)))
+#endif
+
+typedef struct {
+    const char *name;
+    size_t len;
+    unsigned char ext_off;      /* as in entry_t */
+    unsigned char type;         /* d_type */
+    unsigned char hidden;       /* starts with '.' */
+} dir_rec_t;
+
+__attribute__((no_sanitize_address))
+static void name_scan(dir_rec_t *rec) {
+    const char *s = rec->name;
+#ifdef SCAN_WIDTH
+    const scan_vec_t nul = SCAN_SPLAT(0), dot = SCAN_SPLAT('.');
+    unsigned skew = (unsigned)((uintptr_t)s & (SCAN_WIDTH - 1));
+    const char *p = s - skew;
+    uint32_t keep = ~0u << skew;
+    ptrdiff_t last_dot = -1;
+    scan_vec_t v = SCAN_LOAD(p);
+    uint32_t z = SCAN_MATCH(v, nul) & keep;
+    uint32_t d = SCAN_MATCH(v, dot) & keep;
+    rec->hidden = (d >> skew) & 1;
+    while (!z) {
+        if (d) last_dot = (p - s) + 31 - __builtin_clz(d);
+        p += SCAN_WIDTH;
+        v = SCAN_LOAD(p);
+        z = SCAN_MATCH(v, nul);
+        d = SCAN_MATCH(v, dot);
+    }
+    d &= (1u << __builtin_ctz(z)) - 1;      /* dots past the NUL */
+    if (d) last_dot = (p - s) + 31 - __builtin_clz(d);
+    rec->len = (size_t)((p - s) + __builtin_ctz(z));
+    rec->ext_off = (unsigned char)(last_dot + 1);
+#else
+    size_t i = 0, dot = 0;
+    for (; s[i]; i++)
+        if (s[i] == '.') dot = i + 1;
+    rec->len = i;
+    rec->ext_off = (unsigned char)dot;
+    rec->hidden = s[0] == '.';
+#endif
+}
+
+/* ---------- Directory reader ----------
+ * Yields a name_scan()ed record for each entry. By default this wraps
+ * readdir(); with --dirbuf the records are pulled straight out of a large
+ * getdents64 buffer on dirfd(), which cuts the syscall count on huge
+ * directories and skips the per-entry struct dirent copy.
+ */
+struct linux_dirent64 {
+    ino_t          d_ino;
+    off_t          d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+typedef struct {
+    DIR *dirp;
+    char *buf;          /* NULL when using readdir() */
+    size_t size, len, pos;
+} dir_reader_t;
+
+static int dir_reader_init(dir_reader_t *r, DIR *dirp) {
+    r->dirp = dirp;
+    r->buf = NULL;
+    r->size = r->len = r->pos = 0;
+    if (opts.dirbuf_size > 0) {
+        r->buf = malloc(opts.dirbuf_size);
+        if (!r->buf) return -1;
+        r->size = opts.dirbuf_size;
+    }
+    return 0;
+}
+
+/* Returns 1 with an entry, 0 at end of directory, -1 on error. */
+static int dir_reader_next(dir_reader_t *r, dir_rec_t *rec) {
+    if (!r->buf) {
+        errno = 0;
+        struct dirent *dp = readdir(r->dirp);
+        if (!dp) return errno ? -1 : 0;
+        rec->name = dp->d_name;
+        rec->type = dp->d_type;
+        name_scan(rec);
+        return 1;
+    }
+
+    if (r->pos >= r->len) {
+        long n = syscall(SYS_getdents64, dirfd(r->dirp), r->buf, r->size);
+        STATS_COUNT(CTR_SYS_GETDENTS, 1);
+        if (n < 0) return -1;
+        if (n == 0) return 0;
+        r->len = (size_t)n;
+        r->pos = 0;
+    }
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(r->buf + r->pos);
+    r->pos += d->d_reclen;
+    rec->name = d->d_name;
+    rec->type = d->d_type;
+    name_scan(rec);
+    return 1;
+}
+
+static void dir_reader_close(dir_reader_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+/* ---------- Helper: per-entry metadata fill ---------- */
+/* Name-only modes: d_type alone is enough unless we need the
+ * executable bits of a regular file (for color) or the type is unknown.
+ * -L needs what links point at, and -R under -L or --one-file-system
+ * the device (and inode) of every directory.
+ */
+static int entry_needs_stat(const entry_t *e, int meta) {
+    return meta != META_COLOR || e->d_type == DT_UNKNOWN ||
+           (e->d_type == DT_REG && opts.color) ||
+           (e->d_type == DT_DIR && colors.dir_modes) ||
+           (e->d_type == DT_LNK && opts.follow) ||
+           (e->d_type == DT_DIR && (opts.follow || opts.one_fs));
+}
+
+/* Completes an entry once e->st is known: link target and color. */
+static void finish_entry_meta(int dfd, entry_t *e, int meta, arena_t *arena) {
+    if (S_ISLNK(e->st.st_mode)) {
+        e->is_link = 1;
+    }
+    if (e->is_link && (meta & META_FULL)) {
+        char target[PATH_MAX];
+        STATS_START(t0);
+        ssize_t len = readlinkat(dfd, e->name, target, sizeof(target) - 1);
+        STATS_STOP(PH_READLINK, t0);
+        STATS_COUNT(CTR_SYS_READLINK, 1);
+        if (len >= 0)
+            e->link_target = arena_strndup(arena, target, (size_t)len);
+    }
+    e->color = classify_color(e);
+}
+
+/* Fills st, link/color fields of an entry whose name and d_type are set.
+ * Returns -1 (errno set) if the entry could not be stat'ed.
+ */
+static int fill_entry_meta(int dfd, entry_t *e, int meta, arena_t *arena) {
+    e->is_link = 0;
+    e->link_target = NULL;
+
+    if (!entry_needs_stat(e, meta)) {
+        memset(&e->st, 0, sizeof(e->st));
+        e->st.st_mode = DTTOIF(e->d_type);
+        e->is_link = (e->d_type == DT_LNK);
+        e->color = classify_color(e);
+        return 0;
+    }
+
+    if (fetch_stat(dfd, e->name, meta, &e->st) == -1)
+        return -1;
+
+    finish_entry_meta(dfd, e, meta, arena);
+    return 0;
+}
+
+/* Drops entries whose errs[] slot is set, reporting them in order. */
+static size_t drop_failed_entries(const char *path, entry_t *arr, size_t count,
+                                  const int *errs) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (errs[i]) {
+            /* on lstat failure, print error and continue (skip this entry) */
+            errno = errs[i];
+            warn_at(path, arr[i].name);
+            continue;
+        }
+        arr[kept++] = arr[i];
+    }
+    return kept;
+}
+
+/* Deferred metadata pass on the calling thread. */
+static size_t stat_entries_serial(int dfd, const char *path, int meta,
+                                  entry_t *arr, size_t count, arena_t *arena) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (fill_entry_meta(dfd, &arr[i], meta, arena) == -1) {
+            warn_at(path, arr[i].name);
+            continue;
+        }
+        arr[kept++] = arr[i];
+    }
+    return kept;
+}
+
+/* ---------- Parallel metadata for one huge directory (--stat-jobs) ----------
+ * After the readdir pass the entry array is cut into chunks that
+ * --stat-jobs threads claim from a shared counter, so the per-entry
+ * stat round-trips overlap. Each thread keeps its own arena for link
+ * targets; those are spliced into the directory's arena afterwards and
+ * failures are reported in directory order, exactly as the serial loop
+ * would have.
+ */
+#define PAR_STAT_MIN   1024     /* below this, threads are not worth it */
+#define PAR_STAT_CHUNK 256
+
+typedef struct {
+    entry_t *ents;
+    int *errs;
+    size_t count;
+    int dfd, meta;
+    atomic_size_t next;
+} stat_job_t;
+
+typedef struct {
+    stat_job_t *job;
+    arena_t arena;
+} stat_worker_t;
+
+static void *stat_worker(void *arg) {
+    stat_worker_t *w = arg;
+    stat_job_t *job = w->job;
+    for (;;) {
+        size_t lo = atomic_fetch_add(&job->next, PAR_STAT_CHUNK);
+        if (lo >= job->count) break;
+        size_t hi = lo + PAR_STAT_CHUNK < job->count ? lo + PAR_STAT_CHUNK : job->count;
+        for (size_t i = lo; i < hi; i++)
+            if (fill_entry_meta(job->dfd, &job->ents[i], job->meta, &w->arena) == -1)
+                job->errs[i] = errno ? errno : EIO;
+    }
+    return NULL;
+}
+
+static void arena_splice(arena_t *dst, arena_t *src) {
+    arena_chunk_t *c = src->head;
+    if (!c) return;
+    while (c->next) c = c->next;
+    /* keep dst's partly used head chunk in front for later allocations */
+    if (dst->head) {
+        c->next = dst->head->next;
+        dst->head->next = src->head;
+    } else {
+        dst->head = src->head;
+    }
+    src->head = NULL;
+}
+
+/* Returns the number of entries kept after dropping failed ones. */
+static size_t stat_entries_parallel(int dfd, const char *path, int meta,
+                                    entry_t *arr, size_t count, arena_t *arena) {
+    int nthreads = opts.stat_jobs;
+    int *errs = calloc(count, sizeof(int));
+    stat_worker_t *workers = calloc((size_t)nthreads, sizeof(*workers));
+    pthread_t *tids = calloc((size_t)nthreads, sizeof(*tids));
+    stat_job_t job = { arr, errs, count, dfd, meta, 0 };
+    int started = 0;
+
+    if (errs && workers && tids) {
+        for (; started < nthreads; started++) {
+            workers[started].job = &job;
+            arena_init(&workers[started].arena);
+            if (pthread_create(&tids[started], NULL, stat_worker, &workers[started]) != 0)
+                break;
+        }
+    }
+    if (started == 0) {
+        /* no threads after all: do it here */
+        free(tids);
+        free(workers);
+        free(errs);
+        return stat_entries_serial(dfd, path, meta, arr, count, arena);
+    }
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+        arena_splice(arena, &workers[t].arena);
+    }
+
+    size_t kept = drop_failed_entries(path, arr, count, errs);
+    free(errs);
+    free(workers);
+    free(tids);
+    return kept;
+}
+
+/* ---------- io_uring metadata backend (--io-uring) ----------
+ * Built with `make IO_URING=1`. Talks to the kernel directly through
+ * io_uring_setup/io_uring_enter, so liburing is not needed. Entries that
+ * need metadata are submitted as IORING_OP_STATX batches of up to
+ * --uring-depth requests. io_uring has no readlinkat opcode, so symlink
+ * targets are still read synchronously as their statx completes.
+ * Each thread sets up its own ring on first use; if the kernel refuses
+ * (old kernel, seccomp) the caller falls back to the other paths.
+ */
+#if defined(USE_IO_URING) && defined(STATX_TYPE)
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned depth;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    struct statx *bufs;             /* one per in-flight request */
+    unsigned *free_bufs;
+    unsigned nfree;
+} uring_t;
+
+static _Thread_local uring_t *tl_ring;
+static _Thread_local int tl_ring_failed;
+
+static void uring_release(void) {
+    uring_t *r = tl_ring;
+    if (!r) return;
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd >= 0) close(r->fd);
+    free(r->bufs);
+    free(r->free_bufs);
+    free(r);
+    tl_ring = NULL;
+}
+
+static uring_t *uring_get(void) {
+    if (tl_ring || tl_ring_failed) return tl_ring;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    uring_t *r = calloc(1, sizeof(*r));
+    if (!r) goto fail;
+    tl_ring = r;
+    r->fd = (int)syscall(SYS_io_uring_setup, (unsigned)opts.uring_depth, &p);
+    if (r->fd < 0) goto fail;
+
+    r->depth = p.sq_entries;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) { r->sq_ptr = NULL; goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) { r->cq_ptr = NULL; goto fail; }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; goto fail; }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->bufs = malloc(r->depth * sizeof(struct statx));
+    r->free_bufs = malloc(r->depth * sizeof(unsigned));
+    if (!r->bufs || !r->free_bufs) goto fail;
+    for (unsigned i = 0; i < r->depth; i++)
+        r->free_bufs[i] = i;
+    r->nfree = r->depth;
+    return r;
+
+fail:
+    uring_release();
+    tl_ring_failed = 1;
+    return NULL;
+}
+
+#define URING_SUBMITTED (-1)    /* errs[] marker: request still in the ring */
+
+/* Takes every completion off r's queue; returns how many there were. */
+static unsigned uring_reap(uring_t *r, int dfd, int meta, entry_t *arr, int *errs,
+                           arena_t *arena) {
+    unsigned head = *r->cq_head, n = 0;
+    unsigned ctail = atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire);
+    while (head != ctail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        size_t i = (size_t)(cqe->user_data >> 16);
+        unsigned buf = (unsigned)(cqe->user_data & 0xffff);
+        if (cqe->res < 0 && opts.follow && (cqe->res == -ENOENT || cqe->res == -ELOOP)) {
+            /* dangling link: show the link itself */
+            errs[i] = fill_entry_meta(dfd, &arr[i], meta, arena) == -1 ? errno : 0;
+        } else if (cqe->res < 0) {
+            errs[i] = -cqe->res;
+        } else {
+            errs[i] = 0;
+            statx_to_stat(&r->bufs[buf], &arr[i].st);
+            finish_entry_meta(dfd, &arr[i], meta, arena);
+        }
+        r->free_bufs[r->nfree++] = buf;
+        head++;
+        n++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)r->cq_head, head, memory_order_release);
+    return n;
+}
+
+/* Returns the number of entries kept, or (size_t)-1 if no ring is
+ * available and the caller should use another backend. */
+
+static size_t stat_entries_uring(int dfd, const char *path, int meta,
+                                 entry_t *arr, size_t count, arena_t *arena) {
+    uring_t *r = uring_get();
+    if (!r) return (size_t)-1;
+    int *errs = calloc(count, sizeof(int));
+    if (!errs) return (size_t)-1;
+
+    unsigned mask = statx_mask_for(meta);
+    int flags = (opts.follow ? 0 : AT_SYMLINK_NOFOLLOW) |
+                (opts.dont_sync ? AT_STATX_DONT_SYNC : 0);
+    size_t next = 0;
+    unsigned inflight = 0, unsubmitted = 0;
+    int broken = 0;
+
+    for (;;) {
+        /* queue as many stat requests as there are free buffers */
+        unsigned tail = *r->sq_tail;
+        unsigned queued = 0;
+        while (next < count && r->nfree > 0) {
+            entry_t *e = &arr[next];
+            e->is_link = 0;
+            e->link_target = NULL;
+            if (!entry_needs_stat(e, meta)) {
+                fill_entry_meta(dfd, e, meta, arena);
+                next++;
+                continue;
+            }
+            unsigned buf = r->free_bufs[--r->nfree];
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dfd;
+            sqe->addr = (unsigned long long)(uintptr_t)e->name;
+            sqe->len = mask;
+            sqe->off = (unsigned long long)(uintptr_t)&r->bufs[buf];
+            sqe->statx_flags = (unsigned)flags;
+            sqe->user_data = ((unsigned long long)next << 16) | buf;
+            r->sq_array[idx] = idx;
+            errs[next] = URING_SUBMITTED;
+            tail++;
+            queued++;
+            next++;
+        }
+        if (queued > 0)
+            atomic_store_explicit((_Atomic unsigned *)r->sq_tail, tail, memory_order_release);
+        inflight += queued;
+        unsubmitted += queued;
+        if (inflight == 0) break;
+
+        STATS_START(t0);
+        long rc = syscall(SYS_io_uring_enter, r->fd, unsubmitted, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        STATS_STOP(PH_STAT, t0);
+        STATS_COUNT(CTR_SYS_URING, 1);
+        if (rc < 0 && errno != EINTR) {
+            broken = 1;
+            break;
+        }
+        if (rc > 0) unsubmitted -= (unsigned)rc < unsubmitted ? (unsigned)rc : unsubmitted;
+        inflight -= uring_reap(r, dfd, meta, arr, errs, arena);
+    }
+
+    if (broken) {
+        /* what the kernel took still completes into r->bufs: wait for it,
+         * submitting nothing more, before the ring and buffers go. If even
+         * that fails there is no telling when they are done with, so the
+         * buffers are left allocated. */
+        unsigned taken = inflight - unsubmitted;
+        while (taken > 0) {
+            long rc = syscall(SYS_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            STATS_COUNT(CTR_SYS_URING, 1);
+            if (rc < 0 && errno != EINTR) {
+                r->bufs = NULL;
+                break;
+            }
+            unsigned got = uring_reap(r, dfd, meta, arr, errs, arena);
+            taken -= got < taken ? got : taken;
+        }
+        /* then drop the ring for this thread and finish everything it did
+         * not answer synchronously */
+        uring_release();
+        tl_ring_failed = 1;
+        for (size_t i = 0; i < count; i++) {
+            if (i < next && errs[i] != URING_SUBMITTED) continue;
+            errs[i] = fill_entry_meta(dfd, &arr[i], meta, arena) == -1 ? errno : 0;
+        }
+    }
+
+    size_t kept = drop_failed_entries(path, arr, count, errs);
+    free(errs);
+    return kept;
+}
+#else
+static void uring_release(void) {
+}
+
+static size_t stat_entries_uring(int dfd, const char *path, int meta,
+                                 entry_t *arr, size_t count, arena_t *arena) {
+    (void)dfd; (void)path; (void)meta; (void)arr; (void)count; (void)arena;
+    return (size_t)-1;
+}
+#endif
+
+/* ---------- Metadata pass dispatch ---------- */
+/* Fills metadata for entries that so far only have a name and d_type,
+ * using io_uring, --stat-jobs threads or the calling thread, and returns
+ * how many entries survived.
+ */
+static size_t stat_entries(int dfd, const char *path, int meta,
+                           entry_t *arr, size_t count, arena_t *arena) {
+    size_t kept = opts.io_uring ?
+        stat_entries_uring(dfd, path, meta, arr, count, arena) : (size_t)-1;
+    if (kept != (size_t)-1)
+        return kept;
+    if (opts.stat_jobs > 1 && count >= PAR_STAT_MIN)
+        return stat_entries_parallel(dfd, path, meta, arr, count, arena);
+    return stat_entries_serial(dfd, path, meta, arr, count, arena);
+}
+
+/* ---------- Helper: read directory ---------- */
+/* Reads every visible entry of an already opened directory. All metadata
+ * lookups go through dirfd(dirp) with *at() calls; path is only used for
+ * error messages. The stream is left open for the caller.
+ */
+static entry_t *read_dir_entries(DIR *dirp, const char *path, int meta,
+                                 size_t *out_count, arena_t *arena) {
+    STATS_START(t0);
+    entry_t *arr = read_dir_entries_raw(dirp, path, meta, out_count, arena);
+    STATS_STOP(PH_READ, t0);
+    STATS_COUNT(CTR_DIRS, 1);
+    if (arr) STATS_COUNT(CTR_ENTRIES, *out_count);
+    return arr;
+}
+
+static entry_t *read_dir_entries_raw(DIR *dirp, const char *path, int meta,
+                                     size_t *out_count, arena_t *arena) {
+    int dfd = dirfd(dirp);
+    int deferred = opts.stat_jobs > 1 || opts.io_uring;  /* stat after the readdir pass */
+    dir_reader_t rd;
+    if (dir_reader_init(&rd, dirp) == -1) {
+        warn("malloc");
+        return NULL;
+    }
+
+    size_t cap = 64, count = 0;
+    entry_t *arr = malloc(cap * sizeof(entry_t));
+    if (!arr) {
+        warn("malloc");
+        dir_reader_close(&rd);
+        return NULL;
+    }
+
+    dir_rec_t rec;
+    int rc;
+    while ((rc = dir_reader_next(&rd, &rec)) > 0) {
+        if (rec.hidden && !opts.all)
+            continue; // skip hidden files
+
+        if (count == cap) {
+            cap *= 2;
+            entry_t *tmp = realloc(arr, cap * sizeof(entry_t));
+            if (!tmp) {
+                warn("realloc");
+                free(arr);
+                dir_reader_close(&rd);
+                return NULL;
+            }
+            arr = tmp;
+        }
+
+        arr[count].name = arena_strndup(arena, rec.name, rec.len);
+        if (!arr[count].name) {
+            warn("malloc");
+            free(arr);
+            dir_reader_close(&rd);
+            return NULL;
+        }
+        arr[count].name_len = (unsigned int)rec.len;
+        arr[count].ext_off = rec.ext_off;
+        arr[count].d_type = rec.type;
+
+        if (!deferred && fill_entry_meta(dfd, &arr[count], meta, arena) == -1) {
+            /* on lstat failure, print error and continue (skip this entry) */
+            warn_at(path, rec.name);
+            continue;
+        }
+        count++;
+    }
+    if (rc < 0)
+        warn(path);
+    dir_reader_close(&rd);
+
+    if (deferred)
+        count = stat_entries(dfd, path, meta, arr, count, arena);
+
+    *out_count = count;
+    return arr;
+}
+
+/* ---------- Sort engine ----------
+ * Sorting works on 16-byte items holding a precomputed 64-bit key and a
+ * pointer to the entry instead of on entry_t itself. For names the key
+ * is the first 8 bytes of the name, big-endian, so most comparisons are
+ * a single integer compare and the full strcmp() only runs on ties.
+ * Large arrays use an MSD radix sort over the key bytes; equal-key runs
+ * and small buckets fall back to a comparison sort. The entries are then
+ * moved into sorted order in place, reversed for -r, by following the
+ * permutation's cycles, so a huge directory needs no second entry_t
+ * array.
+ *
+ * Other orders plug in a key of their own: -t and -S store the
+ * complemented mtime or size so that ascending order means newest or
+ * largest first, and -X uses the '.' and the first 7 bytes of the
+ * extension.
+ */
+#define RADIX_MIN   4096        /* below this, a comparison sort wins */
+#define RADIX_SMALL 64          /* bucket size that stops the recursion */
+
+typedef int (*tie_fn)(const entry_t *a, const entry_t *b);
+
+typedef struct {
+    uint64_t key;
+    entry_t *e;
+} sort_item_t;
+
+static uint64_t name_prefix_key(const entry_t *e) {
+    uint64_t k = 0;
+    size_t n = e->name_len < 8 ? e->name_len : 8;
+    for (size_t i = 0; i < 8; i++)
+        k = (k << 8) | (i < n ? (unsigned char)e->name[i] : 0);
+    return k;
+}
+
+static int tie_by_name(const entry_t *a, const entry_t *b) {
+    return strcmp(a->name, b->name);
+}
+
+/* -t: newest first; the key holds seconds, nanoseconds break ties. */
+static uint64_t mtime_key(const entry_t *e) {
+    return ~((uint64_t)e->st.st_mtim.tv_sec ^ (1ULL << 63));
+}
+
+static int tie_by_mtime(const entry_t *a, const entry_t *b) {
+    if (a->st.st_mtim.tv_nsec != b->st.st_mtim.tv_nsec)
+        return a->st.st_mtim.tv_nsec > b->st.st_mtim.tv_nsec ? -1 : 1;
+    return tie_by_name(a, b);
+}
+
+/* -S: largest first. */
+static uint64_t size_key(const entry_t *e) {
+    return ~(uint64_t)e->st.st_size;
+}
+
+/* -X: by the text after the last '.'. As in GNU ls, names without a
+ * '.' come first, then names ending in one ("foo.", an empty extension),
+ * then the rest. */
+static const char *entry_ext(const entry_t *e) {
+    return e->ext_off ? e->name + e->ext_off : "";
+}
+
+/* The key spells the extension with its '.', so "foo." gets "." and
+ * sorts between "foo" (0) and "foo.c" (".c"). */
+static uint64_t ext_key(const entry_t *e) {
+    if (!e->ext_off) return 0;
+    const char *ext = entry_ext(e);
+    uint64_t k = '.';
+    int i = 0;
+    for (; i < 7 && ext[i]; i++)
+        k = (k << 8) | (unsigned char)ext[i];
+    return k << (8 * (7 - i));
+}
+
+static int tie_by_ext(const entry_t *a, const entry_t *b) {
+    if (!a->ext_off != !b->ext_off) return a->ext_off ? 1 : -1;
+    int c = strcmp(entry_ext(a), entry_ext(b));
+    return c ? c : tie_by_name(a, b);
+}
+
+typedef struct {
+    uint64_t (*key)(const entry_t *e);
+    tie_fn tie;
+} sort_spec_t;
+
+static const sort_spec_t sort_specs[] = {
+    [SORT_NAME] = { name_prefix_key, tie_by_name },
+    [SORT_TIME] = { mtime_key, tie_by_mtime },
+    [SORT_SIZE] = { size_key, tie_by_name },
+    [SORT_EXT]  = { ext_key, tie_by_ext },
+};
+
+static int cmp_items(const void *pa, const void *pb, void *ctx) {
+    const sort_item_t *a = pa, *b = pb;
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    return ((tie_fn)ctx)(a->e, b->e);
+}
+
+static void sort_items_cmp(sort_item_t *a, size_t n, tie_fn tie) {
+    qsort_r(a, n, sizeof(*a), cmp_items, (void *)tie);
+}
+
+/* The same order straight on entry_t, for when there is no memory for
+ * the items; names are unique, so -r is the comparison turned around. */
+static int cmp_entries(const void *pa, const void *pb, void *ctx) {
+    const sort_spec_t *spec = ctx;
+    const entry_t *a = pa, *b = pb;
+    uint64_t ka = spec->key(a), kb = spec->key(b);
+    int c = ka != kb ? (ka < kb ? -1 : 1) : spec->tie(a, b);
+    return opts.reverse ? -c : c;
+}
+
+static void radix_sort_items(sort_item_t *a, sort_item_t *tmp, size_t n, int byte, tie_fn tie) {
+    while (n >= RADIX_SMALL && byte < 8) {
+        size_t counts[256] = { 0 };
+        int shift = 56 - 8 * byte;
+        for (size_t i = 0; i < n; i++)
+            counts[(a[i].key >> shift) & 0xff]++;
+
+        /* everything in one bucket: nothing to scatter, look at the next byte */
+        size_t first = (a[0].key >> shift) & 0xff;
+        if (counts[first] == n) {
+            byte++;
+            continue;
+        }
+
+        size_t offs[256], pos = 0;
+        for (int b = 0; b < 256; b++) {
+            offs[b] = pos;
+            pos += counts[b];
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[offs[(a[i].key >> shift) & 0xff]++] = a[i];
+        memcpy(a, tmp, n * sizeof(*a));
+
+        pos = 0;
+        for (int b = 0; b < 256; b++) {
+            if (counts[b] > 1)
+                radix_sort_items(a + pos, tmp + pos, counts[b], byte + 1, tie);
+            pos += counts[b];
+        }
+        return;
+    }
+    if (n > 1)
+        sort_items_cmp(a, n, tie);
+}
+
+static void sort_entries(entry_t *arr, size_t n) {
+    if (n < 2) return;
+    const sort_spec_t *spec = &sort_specs[opts.sort_key];
+    sort_item_t *items = malloc(n * sizeof(*items));
+    if (!items) {
+        /* short on memory: sort the entries themselves */
+        qsort_r(arr, n, sizeof(entry_t), cmp_entries, (void *)spec);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        items[i].key = spec->key(&arr[i]);
+        items[i].e = &arr[i];
+    }
+    sort_item_t *tmp = n >= RADIX_MIN ? malloc(n * sizeof(*tmp)) : NULL;
+    if (tmp)
+        radix_sort_items(items, tmp, n, 0, spec->tie);
+    else
+        sort_items_cmp(items, n, spec->tie);
+    free(tmp);
+
+    /* key becomes the index of the entry that goes to position i */
+    for (size_t i = 0; i < n; i++)
+        items[i].key = (uint64_t)(items[i].e - arr);
+    if (opts.reverse) {
+        for (size_t i = 0, j = n - 1; i < j; i++, j--) {
+            uint64_t k = items[i].key;
+            items[i].key = items[j].key;
+            items[j].key = k;
+        }
+    }
+    /* each cycle moves through one spare entry; done slots point at themselves */
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].key == i) continue;
+        entry_t spare = arr[i];
+        size_t j = i;
+        for (;;) {
+            size_t from = (size_t)items[j].key;
+            items[j].key = j;
+            if (from == i) {
+                arr[j] = spare;
+                break;
+            }
+            arr[j] = arr[from];
+            j = from;
+        }
+    }
+    free(items);
+}
+
+/* ---------- Color database ---------- */
+static uint32_t color_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    return h;
+}
+
+static int color_casecmp(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        int c = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+        if (c) return c;
+    }
+    return 0;
+}
+
+/* Decodes the escapes dircolors allows (\e, \NNN, \xHH, ^X, ...) in place
+ * and returns the new length. */
+static size_t color_unescape(char *s, size_t len) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '^' && i + 1 < len) {
+            c = s[++i] == '?' ? 127 : (char)(toupper((unsigned char)s[i]) & 0x1f);
+        } else if (c == '\\' && i + 1 < len) {
+            c = s[++i];
+            if (c >= '0' && c <= '7') {
+                int v = 0;
+                for (int k = 0; k < 3 && i < len && s[i] >= '0' && s[i] <= '7'; k++)
+                    v = v * 8 + (s[i++] - '0');
+                i--;
+                c = (char)v;
+            } else if (c == 'x' && i + 1 < len && isxdigit((unsigned char)s[i + 1])) {
+                int v = 0;
+                for (int k = 0; k < 2 && i + 1 < len && isxdigit((unsigned char)s[i + 1]); k++) {
+                    char d = s[++i];
+                    v = v * 16 + (isdigit((unsigned char)d) ? d - '0' : tolower((unsigned char)d) - 'a' + 10);
+                }
+                c = (char)v;
+            } else {
+                switch (c) {
+                case 'e': c = 27; break;
+                case 'a': c = 7; break;
+                case 'b': c = 8; break;
+                case 'f': c = 12; break;
+                case 'n': c = 10; break;
+                case 'r': c = 13; break;
+                case 't': c = 9; break;
+                case 'v': c = 11; break;
+                case '_': c = ' '; break;
+                default: break;         /* \\, \^, \: and anything else */
+                }
+            }
+        }
+        s[o++] = c;
+    }
+    return o;
+}
+
+/* One parsed "key=value" item; value points into the parse buffer. */
+typedef struct {
+    const char *key, *val;
+    size_t key_len, val_len;
+} color_item_t;
+
+static color_seq_t color_render(const char *pre, size_t pre_len, const char *val,
+                                size_t val_len, const char *suf, size_t suf_len) {
+    color_seq_t c = { NULL, 0 };
+    if (val_len == 0) return c;     /* empty value: leave the name uncolored */
+    c.seq = malloc(pre_len + val_len + suf_len);
+    if (!c.seq) return c;
+    memcpy(c.seq, pre, pre_len);
+    memcpy(c.seq + pre_len, val, val_len);
+    memcpy(c.seq + pre_len + val_len, suf, suf_len);
+    c.len = pre_len + val_len + suf_len;
+    return c;
+}
+
+/* Color index for an extension pattern's value, shared by equal values.
+ * Past CLR_MAX distinct colors the rest fall back to plain. */
+static unsigned char color_intern(color_seq_t c) {
+    for (unsigned i = CLR_COUNT; i < colors.nseqs; i++) {
+        if (colors.seqs[i].len == c.len && memcmp(colors.seqs[i].seq, c.seq, c.len) == 0) {
+            free(c.seq);
+            return (unsigned char)i;
+        }
+    }
+    if (colors.nseqs == CLR_MAX || (c.len > 0 && !c.seq)) {
+        free(c.seq);
+        return CLR_PLAIN;
+    }
+    colors.seqs[colors.nseqs] = c;
+    return (unsigned char)colors.nseqs++;
+}
+
+static color_bucket_t *color_bucket(const char *key, size_t key_len, uint32_t h) {
+    size_t mask = colors.nbuckets - 1;
+    for (size_t j = h & mask;; j = (j + 1) & mask) {
+        color_bucket_t *b = &colors.buckets[j];
+        if (!b->first || (b->hash == h && b->key_len == key_len &&
+                          color_casecmp(b->key, key, key_len) == 0))
+            return b;
+    }
+}
+
+static int color_grow_buckets(void) {
+    size_t ncap = colors.nbuckets ? colors.nbuckets * 2 : 64;
+    color_bucket_t *old = colors.buckets;
+    size_t old_cap = colors.nbuckets;
+    colors.buckets = calloc(ncap, sizeof(*colors.buckets));
+    if (!colors.buckets) {
+        colors.buckets = old;
+        return -1;
+    }
+    colors.nbuckets = ncap;
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].first)
+            *color_bucket(old[i].key, old[i].key_len, old[i].hash) = old[i];
+    free(old);
+    return 0;
+}
+
+/* Adds "*suffix" with the given color; a repeated suffix takes the new one. */
+static void color_add_suffix(const char *text, size_t len, unsigned char color) {
+    if (len == 0) return;
+    if ((colors.nkeys + 1) * 2 > colors.nbuckets && color_grow_buckets() == -1) return;
+    if (colors.nsuffixes == colors.suffix_cap) {
+        size_t ncap = colors.suffix_cap ? colors.suffix_cap * 2 : 64;
+        color_suffix_t *tmp = realloc(colors.suffixes, ncap * sizeof(*tmp));
+        if (!tmp) return;
+        colors.suffixes = tmp;
+        colors.suffix_cap = ncap;
+    }
+
+    const char *dot = memrchr(text, '.', len);
+    color_bucket_t *b = NULL;
+    unsigned *link;
+    if (dot) {
+        const char *key = dot + 1;
+        size_t key_len = len - (size_t)(key - text);
+        uint32_t h = color_hash(key, key_len);
+        b = color_bucket(key, key_len, h);
+        link = &b->first;
+        if (!b->first) {
+            b->hash = h;
+            b->key_len = key_len;
+            colors.nkeys++;
+        }
+    } else {
+        link = &colors.tails;
+    }
+    /* keep the chain longest first, so the most specific pattern wins */
+    for (; *link; link = &colors.suffixes[*link - 1].next) {
+        color_suffix_t *o = &colors.suffixes[*link - 1];
+        if (o->len == len && color_casecmp(o->text, text, len) == 0) {
+            o->color = color;
+            return;
+        }
+        if (o->len < len) break;
+    }
+    char *copy = malloc(len);
+    if (!copy) return;
+    for (size_t i = 0; i < len; i++) copy[i] = (char)tolower((unsigned char)text[i]);
+    color_suffix_t *n = &colors.suffixes[colors.nsuffixes];
+    n->text = copy;
+    n->len = len;
+    n->color = color;
+    n->next = *link;
+    *link = (unsigned)++colors.nsuffixes;
+    /* the key lives in the chain head's text */
+    if (b) {
+        const color_suffix_t *head = &colors.suffixes[b->first - 1];
+        b->key = head->text + head->len - b->key_len;
+    }
+}
+
+static const struct {
+    char name[3];
+    unsigned char cls;
+} color_keys[] = {
+    { "no", CLR_PLAIN }, { "fi", CLR_FILE }, { "di", CLR_DIR }, { "ln", CLR_LINK },
+    { "pi", CLR_FIFO }, { "so", CLR_SOCK }, { "bd", CLR_BLK }, { "cd", CLR_CHR },
+    { "ex", CLR_EXEC }, { "su", CLR_SETUID }, { "sg", CLR_SETGID },
+    { "tw", CLR_STICKY_OW }, { "ow", CLR_OTHER_W }, { "st", CLR_STICKY },
+};
+
+/* Splits a copy of an LS_COLORS-style string into items (appended to
+ * *items). Returns the copy, which the items point into. */
+static char *color_parse(const char *spec, color_item_t **items, size_t *n, size_t *cap) {
+    char *buf = strdup(spec);
+    if (!buf) return NULL;
+    for (char *p = buf; *p;) {
+        char *end = p;
+        /* ':' ends an item unless escaped */
+        while (*end && *end != ':') end += (end[0] == '\\' && end[1]) ? 2 : 1;
+        char *eq = p;
+        while (eq < end && *eq != '=') eq += (eq[0] == '\\' && eq + 1 < end) ? 2 : 1;
+        if (eq < end) {
+            if (*n == *cap) {
+                size_t ncap = *cap ? *cap * 2 : 64;
+                color_item_t *tmp = realloc(*items, ncap * sizeof(*tmp));
+                if (!tmp) break;
+                *items = tmp;
+                *cap = ncap;
+            }
+            color_item_t *it = &(*items)[(*n)++];
+            it->key = p;
+            it->key_len = color_unescape(p, (size_t)(eq - p));
+            it->val = eq + 1;
+            it->val_len = color_unescape(eq + 1, (size_t)(end - eq - 1));
+        }
+        p = *end ? end + 1 : end;
+    }
+    return buf;
+}
+
+/* Builds the database from the built-in colors and env, LS_COLORS syntax. */
+static void color_db_init(const char *env) {
+    if (env && !*env) env = NULL;
+    color_item_t *items = NULL;
+    size_t n = 0, cap = 0;
+    char *bufs[2];
+    bufs[0] = color_parse(BUILTIN_TYPE_COLORS, &items, &n, &cap);
+    bufs[1] = color_parse(env ? env : BUILTIN_EXT_COLORS, &items, &n, &cap);
+    colors.sig = env ? color_hash(env, strlen(env)) : 0;
+
+    const char *lc = "\033[", *rc = "m", *ec = NULL, *rs = "0";
+    size_t lc_len = 2, rc_len = 1, ec_len = 0, rs_len = 1;
+    for (size_t i = 0; i < n; i++) {
+        const color_item_t *it = &items[i];
+        if (it->key_len != 2) continue;
+        if (memcmp(it->key, "lc", 2) == 0) { lc = it->val; lc_len = it->val_len; }
+        else if (memcmp(it->key, "rc", 2) == 0) { rc = it->val; rc_len = it->val_len; }
+        else if (memcmp(it->key, "ec", 2) == 0) { ec = it->val; ec_len = it->val_len; }
+        else if (memcmp(it->key, "rs", 2) == 0) { rs = it->val; rs_len = it->val_len; }
+    }
+    colors.reset = ec ? color_render("", 0, ec, ec_len, "", 0) :
+                        color_render(lc, lc_len, rs, rs_len, rc, rc_len);
+    colors.nseqs = CLR_COUNT;
+
+    for (size_t i = 0; i < n; i++) {
+        const color_item_t *it = &items[i];
+        if (it->key_len > 1 && it->key[0] == '*') {
+            color_add_suffix(it->key + 1, it->key_len - 1,
+                             color_intern(color_render(lc, lc_len, it->val, it->val_len, rc, rc_len)));
+            continue;
+        }
+        /* or, mi, mh, ca and do need lookups ls does not make: ignored */
+        for (size_t k = 0; it->key_len == 2 && k < sizeof(color_keys) / sizeof(color_keys[0]); k++) {
+            if (memcmp(it->key, color_keys[k].name, 2) != 0) continue;
+            unsigned char c = color_keys[k].cls;
+            free(colors.seqs[c].seq);
+            colors.seqs[c] = color_render(lc, lc_len, it->val, it->val_len, rc, rc_len);
+            colors.set[c] = 1;
+        }
+    }
+    colors.dir_modes = colors.set[CLR_STICKY_OW] || colors.set[CLR_OTHER_W] ||
+                       colors.set[CLR_STICKY];
+    free(items);
+    free(bufs[0]);
+    free(bufs[1]);
+}
+
+static void color_db_free(void) {
+    for (unsigned i = 0; i < CLR_MAX; i++) free(colors.seqs[i].seq);
+    for (size_t i = 0; i < colors.nsuffixes; i++) free(colors.suffixes[i].text);
+    free(colors.reset.seq);
+    free(colors.suffixes);
+    free(colors.buckets);
+    memset(&colors, 0, sizeof(colors));
+}
+
+/* Color index of a regular file's name from the suffix patterns, or -1. */
+static int color_by_suffix(const entry_t *e) {
+    unsigned first = 0;
+    if (e->ext_off && colors.nkeys) {
+        const char *ext = e->name + e->ext_off;
+        size_t len = e->name_len - e->ext_off;
+        first = color_bucket(ext, len, color_hash(ext, len))->first;
+    }
+    for (int pass = 0; pass < 2; pass++, first = colors.tails) {
+        for (unsigned i = first; i; i = colors.suffixes[i - 1].next) {
+            const color_suffix_t *p = &colors.suffixes[i - 1];
+            if (p->len <= e->name_len &&
+                color_casecmp(e->name + e->name_len - p->len, p->text, p->len) == 0)
+                return p->color;
+        }
+    }
+    return -1;
+}
+
+/* Resolves the color index of an entry once its mode is known,
+ * in GNU ls order. */
+static unsigned char classify_color(const entry_t *e) {
+    if (!opts.color) return CLR_PLAIN;
+    mode_t mode = e->st.st_mode;
+    if (S_ISDIR(mode)) {
+        if ((mode & S_ISVTX) && (mode & S_IWOTH) && colors.set[CLR_STICKY_OW])
+            return CLR_STICKY_OW;
+        if ((mode & S_IWOTH) && colors.set[CLR_OTHER_W])
+            return CLR_OTHER_W;
+        if ((mode & S_ISVTX) && colors.set[CLR_STICKY])
+            return CLR_STICKY;
+        return CLR_DIR;
+    }
+    if (S_ISLNK(mode))  return CLR_LINK;
+    if (S_ISFIFO(mode)) return CLR_FIFO;
+    if (S_ISSOCK(mode)) return CLR_SOCK;
+    if (S_ISBLK(mode))  return CLR_BLK;
+    if (S_ISCHR(mode))  return CLR_CHR;
+    if ((mode & S_ISUID) && colors.set[CLR_SETUID])
+        return CLR_SETUID;
+    if ((mode & S_ISGID) && colors.set[CLR_SETGID])
+        return CLR_SETGID;
+    if ((mode & (S_IXUSR | S_IXGRP | S_IXOTH)) && colors.set[CLR_EXEC])
+        return CLR_EXEC;
+    int c = color_by_suffix(e);
+    if (c >= 0) return (unsigned char)c;
+    return colors.set[CLR_FILE] ? CLR_FILE : CLR_PLAIN;
+}
+
+/* ---------- Path join helper ---------- */
+/* Returns a malloc'd "parent/child" (no length limit), or NULL on OOM. */
+static char *join_path(const char *parent, const char *child) {
+    size_t plen = parent ? strlen(parent) : 0;
+    size_t clen = strlen(child);
+    char *out = malloc(plen + clen + 2);
+    if (!out) return NULL;
+
+    size_t pos = 0;
+    if (plen > 0) {
+        memcpy(out, parent, plen);
+        pos = plen;
+        if (parent[plen - 1] != '/')
+            out[pos++] = '/';
+    }
+    memcpy(out + pos, child, clen + 1);
+    return out;
+}
+
+/* ---------- Persistent directory cache (--cache=FILE) ----------
+ * Sorted entry lists from the previous run, in a file mmap'd read-only at
+ * startup. A directory is looked up by one fstat() of its open descriptor:
+ * (dev, ino, mtime, ctime) and the listing settings must all match, or it
+ * is read and stat'ed as usual. Adding, removing or renaming entries
+ * changes a directory's mtime/ctime; a child's own attributes (a file
+ * growing, a chmod) do not, so with -l those show up once the directory
+ * itself changes. That is the price of skipping the per-entry stat.
+ * Subdirectories are the exception: activity below them touches their
+ * mtime all the time, so they are stat'ed again on every hit.
+ *
+ * Directories modified within DCACHE_RACY_SECS of this run's start are
+ * not stored: a second change in the same timestamp tick would match the
+ * stale stamp. Every directory listed is written to an unnamed O_TMPFILE
+ * next to FILE (FILE.tmp.<pid> where that is unsupported), which replaces
+ * FILE at exit, so an interrupted run leaves the old cache in place.
+ * Records carry a checksum; a damaged or foreign FILE is simply ignored.
+ *
+ * --since=SNAPSHOT reads a file written by --cache (and writes the next
+ * one only if --cache names it) and prints just the directories that do
+ * not match it. Unchanged ones cost an open and an fstat: their entries
+ * are neither read nor stat'ed, but the walk still descends into their
+ * subdirectories, so -R audits scale with directories rather than files.
+ *
+ * Layout, host byte order (only the same build reads it back): a
+ * dcache_hdr_t, then records of a dcache_rec_t, count dcache_ent_t and
+ * the NUL-terminated names and link targets, padded to 8 bytes.
+ */
+#define DCACHE_VERSION   2    /* 2: -X puts "foo." after "foo" */
+#define DCACHE_RACY_SECS 2
+
+typedef struct {
+    char magic[8];                  /* "LSDCACHE" */
+    uint32_t version;
+    uint32_t stat_size;             /* sizeof(struct stat) */
+} dcache_hdr_t;
+
+typedef struct {
+    uint64_t len;                   /* whole record, a multiple of 8 */
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint64_t count;
+    uint32_t config;                /* dcache_config() it was listed with */
+    uint32_t pad;
+    uint64_t sum;                   /* dcache_sum() of the record */
+} dcache_rec_t;
+
+typedef struct {
+    struct stat st;
+    uint32_t name_off, name_len;    /* from the start of the record */
+    uint32_t target_off;            /* 0 if there is no link target */
+    unsigned char is_link, d_type, color, pad;
+} dcache_ent_t;
+
+static struct {
+    int enabled;
+    int changed_only;               /* --since: hits are not revalidated */
+    const char *map;                /* previous run's file, or NULL */
+    size_t map_len;
+    const dcache_rec_t **slots;     /* open addressing on (dev, ino) */
+    size_t cap;
+    pthread_mutex_t lock;           /* guards out and failed */
+    FILE *out;
+    char *path;                     /* where out goes at dcache_close() */
+    char *tmp_path;
+    int tmp_named;                  /* out is tmp_path, not an O_TMPFILE */
+    int failed;
+    time_t started;
+} dcache;
+
+static size_t dcache_hash(uint64_t dev, uint64_t ino, size_t cap) {
+    return (size_t)(((ino * 0x9E3779B97F4A7C15ULL) ^ dev) >> 7) & (cap - 1);
+}
+
+/* Checksum of a record's 8-byte words, its own sum field left out. */
+static uint64_t dcache_sum(const dcache_rec_t *r) {
+    const unsigned char *p = (const unsigned char *)r;
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (size_t off = 0; off < r->len; off += 8) {
+        uint64_t w;
+        if (off == offsetof(dcache_rec_t, sum)) continue;
+        memcpy(&w, p + off, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+/* Everything besides the stamp that changes what a listing holds. */
+static uint32_t dcache_config(int meta) {
+    return (uint32_t)meta | (uint32_t)opts.sort_key << 4 | (uint32_t)opts.reverse << 8 |
+           (uint32_t)opts.all << 9 | (uint32_t)opts.color << 10 |
+           (uint32_t)opts.dont_sync << 11 | (uint32_t)opts.follow << 12 |
+           (uint32_t)opts.one_fs << 13 | (colors.sig & 0xffffu) << 16;
+}
+
+static int dcache_stamp_matches(const dcache_rec_t *r, const struct stat *dst) {
+    return r->dev == (uint64_t)dst->st_dev && r->ino == (uint64_t)dst->st_ino &&
+           r->mtime_sec == (int64_t)dst->st_mtim.tv_sec &&
+           r->mtime_nsec == (int64_t)dst->st_mtim.tv_nsec &&
+           r->ctime_sec == (int64_t)dst->st_ctim.tv_sec &&
+           r->ctime_nsec == (int64_t)dst->st_ctim.tv_nsec;
+}
+
+/* Maps the old file and indexes its records; any inconsistency ends the
+ * scan, keeping only the records before it. */
+static void dcache_map(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;               /* first run */
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(dcache_hdr_t)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const dcache_hdr_t *h = map;
+    size_t len = (size_t)st.st_size, nrecs = 0;
+    if (memcmp(h->magic, "LSDCACHE", 8) != 0 || h->version != DCACHE_VERSION ||
+        h->stat_size != sizeof(struct stat)) {
+        munmap(map, len);
+        return;
+    }
+    dcache.map = map;
+    dcache.map_len = len;
+
+    for (size_t off = sizeof(*h); off + sizeof(dcache_rec_t) <= len; ) {
+        const dcache_rec_t *r = (const dcache_rec_t *)(dcache.map + off);
+        if (r->len < sizeof(*r) || r->len % 8 || r->len > len - off ||
+            r->count > (r->len - sizeof(*r)) / sizeof(dcache_ent_t))
+            break;
+        if (nrecs * 2 >= dcache.cap) {
+            size_t ncap = dcache.cap ? dcache.cap * 2 : 256;
+            const dcache_rec_t **ns = calloc(ncap, sizeof(*ns));
+            if (!ns) break;
+            for (size_t i = 0; i < dcache.cap; i++) {
+                const dcache_rec_t *o = dcache.slots[i];
+                if (!o) continue;
+                size_t k = dcache_hash(o->dev, o->ino, ncap);
+                while (ns[k]) k = (k + 1) & (ncap - 1);
+                ns[k] = o;
+            }
+            free(dcache.slots);
+            dcache.slots = ns;
+            dcache.cap = ncap;
+        }
+        size_t k = dcache_hash(r->dev, r->ino, dcache.cap);
+        while (dcache.slots[k] && (dcache.slots[k]->dev != r->dev || dcache.slots[k]->ino != r->ino))
+            k = (k + 1) & (dcache.cap - 1);
+        if (!dcache.slots[k]) {         /* keep the first if listed twice */
+            dcache.slots[k] = r;
+            nrecs++;
+        }
+        off += r->len;
+    }
+    if (nrecs == 0) {
+        /* header only, or the first record is damaged: nothing to reuse */
+        munmap(map, len);
+        free(dcache.slots);
+        dcache.map = NULL;
+        dcache.map_len = 0;
+        dcache.slots = NULL;
+        dcache.cap = 0;
+    }
+}
+
+/* Maps map_path and, unless path is NULL, starts this run's file for it. */
+static void dcache_open(const char *map_path, const char *path, int changed_only) {
+    dcache.enabled = 1;
+    dcache.changed_only = changed_only;
+    dcache.started = time(NULL);
+    pthread_mutex_init(&dcache.lock, NULL);
+    dcache_map(map_path);
+    if (!path) return;
+
+    dcache_hdr_t h = { "LSDCACHE", DCACHE_VERSION, sizeof(struct stat) };
+    dcache.path = strdup(path);
+    if (!dcache.path || asprintf(&dcache.tmp_path, "%s.tmp.%ld", path, (long)getpid()) < 0) {
+        dcache.tmp_path = NULL;
+        warn("malloc");
+        return;
+    }
+
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, (size_t)(slash - path) + 1) : strdup(".");
+    int fd = dir ? open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644) : -1;
+    free(dir);
+    if (fd == -1) {
+        fd = open(dcache.tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        dcache.tmp_named = 1;
+    }
+    dcache.out = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!dcache.out) {
+        warn(dcache.tmp_path);
+        if (fd != -1) close(fd);
+        return;
+    }
+    if (fwrite(&h, sizeof(h), 1, dcache.out) != 1)
+        dcache.failed = 1;
+}
+
+static void dcache_append(const void *rec, size_t len) {
+    pthread_mutex_lock(&dcache.lock);
+    if (dcache.out && !dcache.failed && fwrite(rec, 1, len, dcache.out) != len)
+        dcache.failed = 1;
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+/* Fills d from a matching record; -1 if there is none or it is damaged. */
+static int dcache_fetch(const struct stat *dst, int meta, dir_listing_t *d) {
+    int dfd = dirfd(d->dirp);
+    if (!dcache.map || dcache.cap == 0) return -1;
+    size_t k = dcache_hash((uint64_t)dst->st_dev, (uint64_t)dst->st_ino, dcache.cap);
+    const dcache_rec_t *r;
+    while ((r = dcache.slots[k]) != NULL &&
+           (r->dev != (uint64_t)dst->st_dev || r->ino != (uint64_t)dst->st_ino))
+        k = (k + 1) & (dcache.cap - 1);
+    if (!r || !dcache_stamp_matches(r, dst) || r->config != dcache_config(meta) ||
+        r->sum != dcache_sum(r))
+        return -1;
+
+    const dcache_ent_t *ce = (const dcache_ent_t *)(r + 1);
+    const char *base = (const char *)r;
+    entry_t *ents = malloc((r->count ? r->count : 1) * sizeof(entry_t));
+    if (!ents) return -1;
+    for (size_t i = 0; i < r->count; i++) {
+        /* names must lie inside the record and be NUL-terminated */
+        if (ce[i].name_off >= r->len || ce[i].name_len >= r->len - ce[i].name_off ||
+            ce[i].name_len > NAME_MAX ||
+            base[ce[i].name_off + ce[i].name_len] != '\0' ||
+            ce[i].target_off >= r->len || memchr(base + ce[i].target_off, '\0',
+                                                  r->len - ce[i].target_off) == NULL) {
+            free(ents);
+            return -1;
+        }
+        ents[i].name = base + ce[i].name_off;
+        ents[i].name_len = ce[i].name_len;
+        dir_rec_t rec = { ents[i].name, 0, 0, 0, 0 };
+        name_scan(&rec);
+        ents[i].ext_off = rec.ext_off;
+        ents[i].st = ce[i].st;
+        ents[i].is_link = ce[i].is_link;
+        ents[i].link_target = ce[i].target_off ? base + ce[i].target_off : NULL;
+        ents[i].d_type = ce[i].d_type;
+        ents[i].color = ce[i].color;
+    }
+    d->ents = ents;
+    d->count = (size_t)r->count;
+    dcache_append(r, (size_t)r->len);   /* still valid: carry it over */
+
+    /* name-only modes only use the type of a subdirectory, and --since
+     * does not print unchanged directories at all */
+    if (meta == META_COLOR || dcache.changed_only) return 0;
+    int changed = 0;
+    for (size_t i = 0; i < d->count; i++) {
+        if (!S_ISDIR(ents[i].st.st_mode)) continue;
+        struct stat st;
+        if (fetch_stat(dfd, ents[i].name, meta, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            free(ents);
+            d->ents = NULL;
+            d->count = 0;
+            return -1;                  /* gone or replaced: read it properly */
+        }
+        changed |= st.st_mtim.tv_sec != ents[i].st.st_mtim.tv_sec ||
+                   st.st_mtim.tv_nsec != ents[i].st.st_mtim.tv_nsec ||
+                   st.st_size != ents[i].st.st_size;
+        ents[i].st = st;
+    }
+    if (changed && opts.sort_key != SORT_NAME && opts.sort_key != SORT_EXT)
+        sort_entries(d->ents, d->count);
+    return 0;
+}
+
+static size_t dcache_pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+/* Serializes a freshly read and sorted listing for the next run. */
+static void dcache_store(const struct stat *dst, int meta, const entry_t *ents, size_t count) {
+    if (!dcache.out) return;
+    if (dst->st_mtim.tv_sec >= dcache.started - DCACHE_RACY_SECS ||
+        dst->st_ctim.tv_sec >= dcache.started - DCACHE_RACY_SECS)
+        return;
+
+    size_t len = sizeof(dcache_rec_t) + count * sizeof(dcache_ent_t);
+    for (size_t i = 0; i < count; i++) {
+        len += ents[i].name_len + 1;
+        if (ents[i].link_target) len += strlen(ents[i].link_target) + 1;
+    }
+    len = dcache_pad8(len);
+    if (len > UINT32_MAX) return;       /* offsets are 32-bit */
+
+    char *buf = calloc(1, len);
+    if (!buf) return;
+    dcache_rec_t *r = (dcache_rec_t *)buf;
+    r->len = len;
+    r->dev = (uint64_t)dst->st_dev;
+    r->ino = (uint64_t)dst->st_ino;
+    r->mtime_sec = (int64_t)dst->st_mtim.tv_sec;
+    r->mtime_nsec = (int64_t)dst->st_mtim.tv_nsec;
+    r->ctime_sec = (int64_t)dst->st_ctim.tv_sec;
+    r->ctime_nsec = (int64_t)dst->st_ctim.tv_nsec;
+    r->count = count;
+    r->config = dcache_config(meta);
+
+    dcache_ent_t *ce = (dcache_ent_t *)(r + 1);
+    size_t off = sizeof(*r) + count * sizeof(*ce);
+    for (size_t i = 0; i < count; i++) {
+        ce[i].st = ents[i].st;
+        ce[i].is_link = (unsigned char)ents[i].is_link;
+        ce[i].d_type = ents[i].d_type;
+        ce[i].color = ents[i].color;
+        ce[i].name_off = (uint32_t)off;
+        ce[i].name_len = ents[i].name_len;
+        memcpy(buf + off, ents[i].name, ents[i].name_len);
+        off += ents[i].name_len + 1;
+        if (ents[i].link_target) {
+            size_t tlen = strlen(ents[i].link_target);
+            ce[i].target_off = (uint32_t)off;
+            memcpy(buf + off, ents[i].link_target, tlen);
+            off += tlen + 1;
+        }
+    }
+    r->sum = dcache_sum(r);
+    dcache_append(buf, len);
+    free(buf);
+}
+
+/* Replaces FILE with this run's listings, then drops the old map. */
+static void dcache_close(void) {
+    const char *path = dcache.path;
+    if (!dcache.enabled) return;
+    if (dcache.out) {
+        int ok = fflush(dcache.out) == 0 && !dcache.failed;
+        if (ok && !dcache.tmp_named) {
+            /* give the O_TMPFILE a name so it can be moved into place */
+            char proc[64];
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fileno(dcache.out));
+            unlink(dcache.tmp_path);
+            ok = linkat(AT_FDCWD, proc, AT_FDCWD, dcache.tmp_path, AT_SYMLINK_FOLLOW) == 0;
+        }
+        if (fclose(dcache.out) != 0) ok = 0;
+        if (!ok || rename(dcache.tmp_path, path) == -1) {
+            warn(path);
+            unlink(dcache.tmp_path);
+        }
+    }
+    free(dcache.tmp_path);
+    free(dcache.path);
+    free(dcache.slots);
+    if (dcache.map) munmap((void *)dcache.map, dcache.map_len);
+    pthread_mutex_destroy(&dcache.lock);
+    memset(&dcache, 0, sizeof(dcache));
+}
+
+/* ---------- Directory load ---------- */
+/* Opens, reads and sorts one directory; name is resolved relative to
+ * parent_fd and path is the display path. Returns -1 (already reported)
+ * if the directory could not be listed.
+ */
+static int load_dir(int parent_fd, const char *name, const char *path, dir_listing_t *d) {
+    d->dirp = open_dir_at(parent_fd, name, path);
+    d->ents = NULL;
+    d->count = 0;
+    d->cached = 0;
+    arena_init(&d->arena);
+    if (!d->dirp) return -1;
+
+    int meta = opts.meta;
+    if (opts.sort_key == SORT_TIME || opts.sort_key == SORT_SIZE)
+        meta |= META_SORTKEY;
+    if (opts.head > 0 && !opts.unsorted) {
+        if (load_dir_topk(path, meta, d) == -1) {
+            free_dir(d);
+            return -1;
+        }
+        return 0;
+    }
+
+    struct stat dst;
+    int cacheable = dcache.enabled && !opts.unsorted && fstat(dirfd(d->dirp), &dst) == 0;
+    if (cacheable) {
+        STATS_COUNT(CTR_SYS_STAT, 1);
+        if (dcache_fetch(&dst, meta, d) == 0) {
+            STATS_COUNT(CTR_DCACHE_HIT, 1);
+            d->cached = 1;
+            return 0;
+        }
+        STATS_COUNT(CTR_DCACHE_MISS, 1);
+    }
+
+    d->ents = read_dir_entries(d->dirp, path, meta, &d->count, &d->arena);
+    if (!d->ents) {
+        free_dir(d);
+        return -1;
+    }
+
+    /* sort alphabetically, unless the caller wants directory order */
+    if (!opts.unsorted) {
+        STATS_START(t0);
+        sort_entries(d->ents, d->count);
+        STATS_STOP(PH_SORT, t0);
+    }
+    if (cacheable) dcache_store(&dst, meta, d->ents, d->count);
+    return 0;
+}
+
+static void free_dir(dir_listing_t *d) {
+    free(d->ents);
+    d->ents = NULL;
+    arena_free(&d->arena);
+    if (d->dirp) closedir(d->dirp);
+    d->dirp = NULL;
+}
+
+/* ---------- -R limits: -L visited set, --one-file-system ----------
+ * Following links can reach a directory twice, or one of its own
+ * ancestors, so under -L every directory listed is remembered by
+ * (st_dev, st_ino) and only listed the first time it comes up in print
+ * order. The set is flat open addressing with linear probing; ino 0
+ * marks a free slot. Both checks use the stat data already loaded with
+ * the entry (entry_needs_stat()). -L keeps -R serial (see ls_walk()).
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} dev_ino_t;
+
+static struct {
+    dev_ino_t *slots;
+    size_t cap, count;      /* cap is a power of two */
+} visited;
+
+static dev_t walk_root_dev;     /* --one-file-system: device of the argument */
+
+static size_t visited_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+/* Returns 1 if (dev, ino) is new, 0 if already seen, -1 on OOM. */
+static int visited_insert(dev_t dev, ino_t ino) {
+    if (ino == 0) return 1;
+    if ((visited.count + 1) * 2 > visited.cap) {
+        size_t ncap = visited.cap ? visited.cap * 2 : 256;
+        dev_ino_t *slots = calloc(ncap, sizeof(*slots));
+        if (!slots) {
+            warn("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < visited.cap; i++) {
+            if (visited.slots[i].ino == 0) continue;
+            size_t j = visited_hash(visited.slots[i].dev, visited.slots[i].ino) & (ncap - 1);
+            while (slots[j].ino != 0) j = (j + 1) & (ncap - 1);
+            slots[j] = visited.slots[i];
+        }
+        free(visited.slots);
+        visited.slots = slots;
+        visited.cap = ncap;
+    }
+    size_t j = visited_hash(dev, ino) & (visited.cap - 1);
+    while (visited.slots[j].ino != 0) {
+        if (visited.slots[j].ino == ino && visited.slots[j].dev == dev) return 0;
+        j = (j + 1) & (visited.cap - 1);
+    }
+    visited.slots[j].dev = dev;
+    visited.slots[j].ino = ino;
+    visited.count++;
+    return 1;
+}
+
+/* Called before each command-line argument is walked. */
+static void walk_limits_begin(int parent_fd, const char *name) {
+    if (!opts.follow && !opts.one_fs) return;
+    if (visited.slots) memset(visited.slots, 0, visited.cap * sizeof(*visited.slots));
+    visited.count = 0;
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, 0) == -1) return;     /* the open reports it */
+    walk_root_dev = st.st_dev;
+    if (opts.follow) visited_insert(st.st_dev, st.st_ino);
+}
+
+/* Subdirectories -R descends into; root_dev is the device of the
+ * command-line path being walked. */
+static int is_subdir_entry(const entry_t *e, dev_t root_dev) {
+    if (!S_ISDIR(e->st.st_mode)) return 0;
+    /* skip . and .. if they ever show up (we skip hidden files but be safe) */
+    if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) return 0;
+    return !opts.one_fs || e->st.st_dev == root_dev;
+}
+
+/* ---------- Streaming unsorted listing (LS_SORT_NONE) ----------
+ * Entries are handed over in directory order, STREAM_BATCH at a time, as
+ * soon as their metadata is in. The batch array and its arena are
+ * reused, so memory stays constant however big the directory is; when
+ * recursive only the names of subdirectories are kept until the
+ * directory has been handed over.
+ */
+#define STREAM_BATCH 1024
+
+/* Called with each batch once its metadata is filled, last set on the
+ * final one; return -1 to stop. */
+typedef int (*batch_fn)(entry_t *batch, size_t count, int last, void *ctx);
+
+/* Reads dirp in batches of STREAM_BATCH, reusing one array and arena.
+ * Strings in a batch are only valid until fn returns. fn always gets its
+ * last call, even when running out of memory cuts the directory short. */
+static void read_dir_batches(DIR *dirp, const char *path, int meta, batch_fn fn, void *ctx) {
+    int dfd = dirfd(dirp);
+    dir_reader_t rd;
+    entry_t *batch = malloc(STREAM_BATCH * sizeof(entry_t));
+    if (!batch || dir_reader_init(&rd, dirp) == -1) {
+        warn("malloc");
+        free(batch);
+        fn(NULL, 0, 1, ctx);
+        return;
+    }
+    arena_t arena;
+    arena_init(&arena);
+
+    dir_rec_t rec;
+    size_t count = 0;
+    int rc;
+    STATS_COUNT(CTR_DIRS, 1);
+    STATS_START(t0);
+    for (;;) {
+        rc = dir_reader_next(&rd, &rec);
+        if (rc > 0) {
+            if (rec.hidden && !opts.all)
+                continue; // skip hidden files
+            entry_t *e = &batch[count];
+            e->name = arena_strndup(&arena, rec.name, rec.len);
+            if (!e->name) {
+                /* hand over what was read and end the directory there */
+                warn("malloc");
+                rc = 0;
+            } else {
+                e->name_len = (unsigned int)rec.len;
+                e->ext_off = rec.ext_off;
+                e->d_type = rec.type;
+                if (++count < STREAM_BATCH)
+                    continue;
+            }
+        }
+
+        /* batch full or directory exhausted: stat, hand over, recycle */
+        count = stat_entries(dfd, path, meta, batch, count, &arena);
+        STATS_STOP(PH_READ, t0);
+        STATS_COUNT(CTR_ENTRIES, count);
+        if (fn(batch, count, rc <= 0, ctx) == -1) {
+            rc = 0;
+            break;
+        }
+        count = 0;
+        arena_reset(&arena);
+        if (rc <= 0) break;
+        STATS_RESTART(t0);
+    }
+    if (rc < 0)
+        warn(path);
+    dir_reader_close(&rd);
+    arena_free(&arena);
+    free(batch);
+}
+
+/* Names of subdirectories still to be listed, packed in one arena;
+ * under -L also their (dev, ino) for the visited set. */
+typedef struct {
+    arena_t arena;
+    char **names;
+    dev_ino_t *ids;         /* -L only */
+    size_t count, cap;
+} name_list_t;
+
+static int name_list_add(name_list_t *l, const entry_t *e) {
+    if (l->count == l->cap) {
+        size_t ncap = l->cap ? l->cap * 2 : 16;
+        char **tmp = realloc(l->names, ncap * sizeof(*l->names));
+        if (!tmp) {
+            warn("realloc");
+            return -1;
+        }
+        l->names = tmp;
+        if (opts.follow) {
+            dev_ino_t *ids = realloc(l->ids, ncap * sizeof(*l->ids));
+            if (!ids) {
+                warn("realloc");
+                return -1;
+            }
+            l->ids = ids;
+        }
+        l->cap = ncap;
+    }
+    char *copy = arena_strndup(&l->arena, e->name, e->name_len);
+    if (!copy) {
+        warn("malloc");
+        return -1;
+    }
+    if (opts.follow) {
+        l->ids[l->count].dev = e->st.st_dev;
+        l->ids[l->count].ino = e->st.st_ino;
+    }
+    l->names[l->count++] = copy;
+    return 0;
+}
+
+static void name_list_free(name_list_t *l) {
+    free(l->names);
+    free(l->ids);
+    arena_free(&l->arena);
+    l->names = NULL;
+    l->ids = NULL;
+    l->count = l->cap = 0;
+}
+
+/* ---------- Walk callbacks ----------
+ * The ls_walk() in progress: its callbacks, how many directories have
+ * been entered, and whether a callback asked to stop (also looked at by
+ * reader threads, which then load nothing more).
+ */
+static const ls_walk_ops_t *walk_ops;
+static size_t walk_entered;
+static int walk_result;
+static atomic_int walk_stopped;
+
+static int walk_check(int rc) {
+    if (rc != 0 && !atomic_load(&walk_stopped)) {
+        walk_result = rc;
+        atomic_store(&walk_stopped, 1);
+    }
+    return rc != 0 ? -1 : 0;
+}
+
+/* Before each directory is opened; -1 if the walk is over. */
+static int walk_enter(const char *path) {
+    if (atomic_load(&walk_stopped)) return -1;
+    size_t index = walk_entered++;
+    if (!walk_ops->enter) return 0;
+    return walk_check(walk_ops->enter(path, index, walk_ops->arg));
+}
+
+static int walk_emit(const char *path, unsigned flags, const entry_t *ents, size_t count) {
+    if (atomic_load(&walk_stopped)) return -1;
+    if (!walk_ops->entries) return 0;
+    ls_dir_info_t info = { path, flags };
+    return walk_check(walk_ops->entries(&info, ents, count, walk_ops->arg));
+}
+
+typedef struct {
+    const char *path;
+    name_list_t *subdirs;   /* NULL unless recursive */
+} stream_ctx_t;
+
+static int stream_batch(entry_t *batch, size_t count, int last, void *arg) {
+    stream_ctx_t *sc = arg;
+    if (walk_emit(sc->path, last ? LS_DIR_END : 0, batch, count) == -1)
+        return -1;
+    for (size_t i = 0; sc->subdirs && i < count; i++) {
+        if (is_subdir_entry(&batch[i], walk_root_dev) && name_list_add(sc->subdirs, &batch[i]) == -1)
+            break;
+    }
+    return 0;
+}
+
+/* Streams one directory, collecting its subdirectories if recursive.
+ * Returns the directory, still open, or NULL if it could not be opened. */
+static DIR *stream_one_dir(int parent_fd, const char *name, const char *path,
+                           name_list_t *subdirs) {
+    DIR *dirp = open_dir_at(parent_fd, name, path);
+    if (!dirp) return NULL;
+
+    stream_ctx_t sc = { path, opts.recursive ? subdirs : NULL };
+    if (walk_emit(path, LS_DIR_BEGIN, NULL, 0) == 0)
+        read_dir_batches(dirp, path, opts.meta, stream_batch, &sc);
+    return dirp;
+}
+
+/* ---------- Top-K listing (--head=K) ----------
+ * Keeps only the K entries that sort first, in a max-heap whose root is
+ * the worst of them, while the directory streams past in batches:
+ * O(N log K) time and memory for K entries however large the directory.
+ * Each heap slot owns one malloc'd block for its name and link target,
+ * reused when the slot is replaced. Under -R only the subdirectories
+ * among the K shown are descended into.
+ */
+typedef struct {
+    entry_t e;
+    uint64_t key;
+    char *strs;
+    size_t strs_cap;
+} topk_slot_t;
+
+typedef struct {
+    const sort_spec_t *spec;
+    topk_slot_t *heap;
+    size_t n, k;
+} topk_ctx_t;
+
+/* <0 if a belongs before b in the final listing */
+static int topk_order(const topk_ctx_t *t, const topk_slot_t *a, uint64_t bkey, const entry_t *b) {
+    int c = a->key < bkey ? -1 : a->key > bkey ? 1 : t->spec->tie(&a->e, b);
+    return opts.reverse ? -c : c;
+}
+
+static void topk_sift_down(topk_ctx_t *t, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, worst = i;
+        if (l < t->n && topk_order(t, &t->heap[l], t->heap[worst].key, &t->heap[worst].e) > 0)
+            worst = l;
+        if (r < t->n && topk_order(t, &t->heap[r], t->heap[worst].key, &t->heap[worst].e) > 0)
+            worst = r;
+        if (worst == i) return;
+        topk_slot_t tmp = t->heap[i];
+        t->heap[i] = t->heap[worst];
+        t->heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void topk_sift_up(topk_ctx_t *t, size_t i) {
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (topk_order(t, &t->heap[i], t->heap[p].key, &t->heap[p].e) <= 0) return;
+        topk_slot_t tmp = t->heap[i];
+        t->heap[i] = t->heap[p];
+        t->heap[p] = tmp;
+        i = p;
+    }
+}
+
+/* Copies e (and its strings) into slot s. */
+static int topk_store(topk_slot_t *s, const entry_t *e, uint64_t key) {
+    size_t tlen = e->link_target ? strlen(e->link_target) + 1 : 0;
+    size_t need = e->name_len + 1 + tlen;
+    if (need > s->strs_cap) {
+        char *nb = realloc(s->strs, need);
+        if (!nb) return -1;
+        s->strs = nb;
+        s->strs_cap = need;
+    }
+    s->e = *e;
+    s->key = key;
+    memcpy(s->strs, e->name, e->name_len + 1);
+    s->e.name = s->strs;
+    if (e->link_target) {
+        memcpy(s->strs + e->name_len + 1, e->link_target, tlen);
+        s->e.link_target = s->strs + e->name_len + 1;
+    }
+    return 0;
+}
+
+static int topk_batch(entry_t *batch, size_t count, int last, void *arg) {
+    topk_ctx_t *t = arg;
+    (void)last;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = t->spec->key(&batch[i]);
+        if (t->n < t->k) {
+            topk_slot_t *s = &t->heap[t->n];
+            s->strs = NULL;
+            s->strs_cap = 0;
+            if (topk_store(s, &batch[i], key) == -1) {
+                warn("malloc");
+                return -1;
+            }
+            t->n++;
+            topk_sift_up(t, t->n - 1);
+        } else if (topk_order(t, &t->heap[0], key, &batch[i]) > 0) {
+            if (topk_store(&t->heap[0], &batch[i], key) == -1) {
+                warn("malloc");
+                return -1;
+            }
+            topk_sift_down(t, 0);
+        }
+    }
+    return 0;
+}
+
+/* load_dir() for --head: fills d with the best K entries, sorted. */
+static int load_dir_topk(const char *path, int meta, dir_listing_t *d) {
+    topk_ctx_t t = { &sort_specs[opts.sort_key], NULL, 0, opts.head };
+    t.heap = malloc(t.k * sizeof(*t.heap));
+    if (!t.heap) {
+        warn("malloc");
+        return -1;
+    }
+    read_dir_batches(d->dirp, path, meta, topk_batch, &t);
+
+    int rc = 0;
+    d->ents = malloc((t.n ? t.n : 1) * sizeof(entry_t));
+    if (!d->ents) {
+        warn("malloc");
+        rc = -1;
+    }
+    for (size_t i = 0; i < t.n; i++) {
+        topk_slot_t *s = &t.heap[i];
+        if (rc == 0) {
+            entry_t *e = &d->ents[d->count];
+            *e = s->e;
+            e->name = arena_strndup(&d->arena, s->e.name, s->e.name_len);
+            if (s->e.link_target)
+                e->link_target = arena_strndup(&d->arena, s->e.link_target,
+                                               strlen(s->e.link_target));
+            if (e->name) d->count++;
+        }
+        free(s->strs);
+    }
+    free(t.heap);
+    if (rc == 0) {
+        STATS_START(t0);
+        sort_entries(d->ents, d->count);
+        STATS_STOP(PH_SORT, t0);
+    }
+    return rc;
+}
+
+/* ---------- Main directory handling (recursive capable) ---------- */
+/* Loads and hands over one directory, collecting its subdirectories if
+ * recursive. Returns the directory, still open, or NULL if it could not
+ * be listed; its entries are already freed.
+ */
+static DIR *list_one_dir(int parent_fd, const char *name, const char *path,
+                         name_list_t *subdirs) {
+    dir_listing_t d;
+    if (load_dir(parent_fd, name, path, &d) == -1) return NULL;
+
+    int rc = walk_emit(path, LS_DIR_BEGIN | LS_DIR_END | (d.cached ? LS_DIR_CACHED : 0),
+                       d.ents, d.count);
+    for (size_t i = 0; rc == 0 && opts.recursive && i < d.count; ++i) {
+        if (is_subdir_entry(&d.ents[i], walk_root_dev) && name_list_add(subdirs, &d.ents[i]) == -1)
+            break;
+    }
+
+    DIR *dirp = d.dirp;
+    d.dirp = NULL;
+    free_dir(&d);
+    return dirp;
+}
+
+/* ---------- Recursive walk (-R) ----------
+ * Depth first, on an explicit heap stack rather than native recursion.
+ * Once a directory is printed, its frame keeps only the names of the
+ * subdirectories still to list and a descriptor to open them relative
+ * to; display paths share one growing buffer. Memory is the directory
+ * being listed plus the pending names, however deep the tree.
+ *
+ * Leaves get no frame, and a frame's descriptor is closed once its last
+ * child is open, so a long chain holds O(1) descriptors. If we still run
+ * out (EMFILE), the outer frames' descriptors are dropped and reopened
+ * when needed, one component at a time from the nearest ancestor that
+ * still has one, so no full path (which may exceed PATH_MAX) is needed.
+ */
+typedef struct {
+    int fd;                 /* for opening children; -1 if dropped */
+    size_t path_len;        /* walk.path[0, path_len) is its display path */
+    size_t name_off;        /* its own name starts here in walk.path */
+    name_list_t subdirs;    /* children still to list */
+    size_t next;
+} walk_frame_t;
+
+static struct {
+    walk_frame_t *frames;
+    size_t depth, cap;
+    char *path;             /* display path of the directory being listed */
+    size_t path_len, path_cap;
+    int root_fd;            /* what frames[0]'s name is relative to */
+} walk;
+
+static void walk_close_below(size_t limit) {
+    for (size_t i = 0; i < limit && i < walk.depth; i++) {
+        if (walk.frames[i].fd >= 0) {
+            close(walk.frames[i].fd);
+            walk.frames[i].fd = -1;
+        }
+    }
+}
+
+/* EMFILE hook for open_dir_at(): drops every frame's descriptor but the
+ * innermost one (the parent being opened from), and the parallel walk's
+ * idle ones. Returns 1 if any went. */
+static int walk_release_fds(void) {
+    int any = 0;
+    for (size_t i = 0; i + 1 < walk.depth; i++)
+        any |= walk.frames[i].fd >= 0;
+    walk_close_below(walk.depth ? walk.depth - 1 : 0);
+    return node_release_fds() | any;
+}
+
+/* Sets walk.path to its first len bytes plus "/name"; returns where the
+ * name starts, or (size_t)-1 on OOM. */
+static size_t walk_path_push(size_t len, const char *name) {
+    size_t nlen = strlen(name);
+    if (len + nlen + 2 > walk.path_cap) {
+        size_t ncap = walk.path_cap ? walk.path_cap : 256;
+        while (ncap < len + nlen + 2) ncap *= 2;
+        char *tmp = realloc(walk.path, ncap);
+        if (!tmp) {
+            warn("realloc");
+            return (size_t)-1;
+        }
+        walk.path = tmp;
+        walk.path_cap = ncap;
+    }
+    if (len > 0 && walk.path[len - 1] != '/')
+        walk.path[len++] = '/';
+    memcpy(walk.path + len, name, nlen + 1);
+    walk.path_len = len + nlen;
+    return len;
+}
+
+/* Descriptor of frame i, reopening it if it was dropped. */
+static int walk_frame_fd(size_t i) {
+    if (walk.frames[i].fd >= 0) return walk.frames[i].fd;
+
+    size_t j = i;
+    while (j > 0 && walk.frames[j - 1].fd < 0) j--;
+    int base = j > 0 ? walk.frames[j - 1].fd : walk.root_fd;
+    for (size_t k = j; k <= i; k++) {
+        const walk_frame_t *f = &walk.frames[k];
+        char *name = strndup(walk.path + f->name_off, f->path_len - f->name_off);
+        int fd = name ? openat(base, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        STATS_COUNT(CTR_SYS_OPEN, 1);
+        if (fd == -1 && name && errno == EMFILE && j > 1) {
+            walk_close_below(j - 1);
+            fd = openat(base, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            STATS_COUNT(CTR_SYS_OPEN, 1);
+        }
+        free(name);
+        if (k > j) close(base);
+        if (fd == -1) {
+            char *path = strndup(walk.path, f->path_len);
+            warn(path ? path : "malloc");
+            free(path);
+            return -1;
+        }
+        base = fd;
+    }
+    walk.frames[i].fd = base;
+    return base;
+}
+
+/* Lists walk.path (name relative to parent_fd) and pushes a frame if it
+ * has subdirectories to visit. */
+static void walk_visit(int parent_fd, const char *name, size_t name_off) {
+    name_list_t subdirs = { { NULL }, NULL, NULL, 0, 0 };
+    STATS_ENTER_DIR();
+    DIR *dirp = opts.unsorted ?
+        stream_one_dir(parent_fd, name, walk.path, &subdirs) :
+        list_one_dir(parent_fd, name, walk.path, &subdirs);
+    if (!dirp || subdirs.count == 0) {
+        if (dirp) closedir(dirp);
+        name_list_free(&subdirs);
+        STATS_LEAVE_DIR();
+        return;
+    }
+
+    if (walk.depth == walk.cap) {
+        size_t ncap = walk.cap ? walk.cap * 2 : 32;
+        walk_frame_t *tmp = realloc(walk.frames, ncap * sizeof(*tmp));
+        if (!tmp) {
+            warn("realloc");
+            closedir(dirp);
+            name_list_free(&subdirs);
+            STATS_LEAVE_DIR();
+            return;
+        }
+        walk.frames = tmp;
+        walk.cap = ncap;
+    }
+    /* a DIR carries a sizeable buffer; a frame only needs the descriptor */
+    int fd = fcntl(dirfd(dirp), F_DUPFD_CLOEXEC, 0);
+    if (fd == -1 && errno == EMFILE) {
+        walk_close_below(walk.depth);
+        fd = fcntl(dirfd(dirp), F_DUPFD_CLOEXEC, 0);
+    }
+    closedir(dirp);         /* fd == -1 still works: it is reopened on demand */
+
+    walk_frame_t *f = &walk.frames[walk.depth++];
+    f->fd = fd;
+    f->path_len = walk.path_len;
+    f->name_off = name_off;
+    f->subdirs = subdirs;
+    f->next = 0;
+}
+
+/* name is resolved relative to parent_fd; path is the display path. */
+static void list_dir(int parent_fd, const char *name, const char *path) {
+    walk.depth = 0;
+    walk.root_fd = parent_fd;
+    if (opts.recursive) walk_limits_begin(parent_fd, name);
+    if (walk_path_push(0, path) == (size_t)-1) return;
+    walk_visit(parent_fd, name, 0);
+
+    while (walk.depth > 0) {
+        size_t top = walk.depth - 1;
+        walk_frame_t *f = &walk.frames[top];
+        if (f->next == f->subdirs.count || atomic_load(&walk_stopped)) {
+            if (f->fd >= 0) close(f->fd);
+            name_list_free(&f->subdirs);
+            walk.depth--;
+            STATS_LEAVE_DIR();
+            continue;
+        }
+
+        size_t ci = f->next++;
+        const char *child = f->subdirs.names[ci];
+        int last = f->next == f->subdirs.count;
+        int pfd = walk_frame_fd(top);
+        if (pfd == -1) {
+            f->next = f->subdirs.count;     /* reported; skip its subtree */
+            continue;
+        }
+        size_t name_off = walk_path_push(f->path_len, child);
+        if (name_off == (size_t)-1) continue;
+        if (opts.follow &&
+            visited_insert(f->subdirs.ids[ci].dev, f->subdirs.ids[ci].ino) != 1) {
+            warn_fmt("%s: not listing already-listed directory", walk.path);
+            continue;
+        }
+
+        if (walk_enter(walk.path) == -1) continue;
+        walk_visit(pfd, child, name_off);
+
+        /* walk_visit() may have moved the stack */
+        if (last && walk.frames[top].fd >= 0) {
+            close(walk.frames[top].fd);
+            walk.frames[top].fd = -1;
+        }
+    }
+}
+
+/* ---------- Parallel traversal (jobs, several paths) ----------
+ * Reader threads load directories (open, read, stat, sort) ahead of the
+ * printer, which is the calling thread and walks the tree in exactly the
+ * depth-first order list_dir() uses, so the callbacks see the same
+ * sequence either way.
+ * Several command-line paths are several trees: all of their roots are
+ * queued up front, in argument order, so a slow server holds up only
+ * its own section of the output while the others are read behind it.
+ *
+ * Every directory is a tree_node. Loading a node creates its children
+ * and pushes them onto the loading worker's deque; a worker pops from
+ * the bottom of its own deque (depth-first, like the printer) and steals
+ * from the top of the others'. If the printer reaches a node nobody has
+ * claimed yet it loads it itself, so limiting read-ahead to
+ * PAR_MAX_INFLIGHT loaded directories can never stall the walk.
+ *
+ * Descriptors work as in list_dir(): a node's DIR is closed as soon as
+ * it is read, and a duplicate of its descriptor is kept only until all
+ * of its children have been opened from it. On EMFILE the idle ones are
+ * dropped and reopened on demand from the nearest ancestor still open,
+ * so depth costs no descriptors.
+ */
+#define PAR_MAX_INFLIGHT 256
+#define ARG_JOBS 8          /* readers for several paths when -j is not given */
+
+enum { NODE_PENDING, NODE_CLAIMED, NODE_DONE };
+
+typedef struct tree_node {
+    char *path;
+    const char *name;               /* last component of path */
+    struct tree_node *parent;       /* NULL for a command-line path */
+    dev_t root_dev;                 /* --one-file-system: device of the tree's root */
+    atomic_int state;
+    atomic_int refs;                /* parent's child list + queue slot */
+    int ok;
+    dir_listing_t dir;
+    struct tree_node **children;
+    size_t nchildren;
+    size_t next;                    /* printer: next child to print */
+    strbuf_t errors;                /* warnings raised while loading */
+    /* under pool.fd_lock */
+    int fd;                         /* for opening children; -1 if dropped */
+    int fd_users;                   /* children being opened from fd */
+    int fd_failed;                  /* reopening failed for good (reported once) */
+    size_t unloaded;                /* children not opened yet */
+    struct tree_node *fd_prev, *fd_next;    /* pool.fd_nodes, while fd >= 0 */
+} tree_node_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    tree_node_t **buf;              /* ring buffer */
+    size_t head, tail, cap;         /* steal at head, push/pop at tail */
+} work_deque_t;
+
+typedef struct {
+    int nworkers;
+    pthread_t *threads;
+    work_deque_t *deques;           /* nworkers + 1; the last is the printer's */
+    pthread_mutex_t lock;           /* guards the condition variables below */
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    atomic_int queued;
+    atomic_int inflight;
+    int shutdown;
+    pthread_mutex_t fd_lock;        /* guards the nodes' descriptor fields */
+    tree_node_t *fd_nodes;          /* nodes holding a descriptor */
+} par_pool_t;
+
+static par_pool_t pool = { .fd_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static tree_node_t *node_new(char *path, size_t name_off, tree_node_t *parent) {
+    tree_node_t *n = calloc(1, sizeof(*n));
+    if (!n) return NULL;
+    n->path = path;
+    n->name = path + name_off;
+    n->parent = parent;
+    if (parent) n->root_dev = parent->root_dev;
+    n->fd = -1;
+    atomic_init(&n->state, NODE_PENDING);
+    atomic_init(&n->refs, 2);
+    return n;
+}
+
+static void node_unref(tree_node_t *n) {
+    if (atomic_fetch_sub(&n->refs, 1) != 1) return;
+    free(n->path);
+    free(n->children);
+    strbuf_free(&n->errors);
+    free(n);
+}
+
+/* ---- node descriptors; the node_fd_* helpers run under pool.fd_lock ---- */
+static void node_fd_set(tree_node_t *n, int fd) {
+    n->fd = fd;
+    n->fd_prev = NULL;
+    n->fd_next = pool.fd_nodes;
+    if (pool.fd_nodes) pool.fd_nodes->fd_prev = n;
+    pool.fd_nodes = n;
+}
+
+static void node_fd_close(tree_node_t *n) {
+    close(n->fd);
+    n->fd = -1;
+    if (n->fd_prev) n->fd_prev->fd_next = n->fd_next;
+    else pool.fd_nodes = n->fd_next;
+    if (n->fd_next) n->fd_next->fd_prev = n->fd_prev;
+}
+
+/* Closes n's descriptor once nothing is left to open from it. */
+static void node_fd_idle(tree_node_t *n) {
+    if (n->fd >= 0 && n->fd_users == 0 && n->unloaded == 0) node_fd_close(n);
+}
+
+/* EMFILE hook: drops every descriptor no child is being opened from. */
+static int node_release_fds(void) {
+    int any = 0;
+    pthread_mutex_lock(&pool.fd_lock);
+    for (tree_node_t *n = pool.fd_nodes, *next; n; n = next) {
+        next = n->fd_next;
+        if (n->fd_users == 0) {
+            node_fd_close(n);
+            any = 1;
+        }
+    }
+    pthread_mutex_unlock(&pool.fd_lock);
+    return any;
+}
+
+/* Descriptor of n's directory for opening a child, reopened from the
+ * nearest open ancestor if it was dropped; give it back with
+ * node_fd_put(). -1 with errno if n cannot be reopened. */
+static int node_child_fd(tree_node_t *n) {
+    pthread_mutex_lock(&pool.fd_lock);
+    if (n->fd >= 0 || n->fd_failed) {
+        int fd = n->fd;
+        if (fd >= 0) n->fd_users++;
+        pthread_mutex_unlock(&pool.fd_lock);
+        return fd;
+    }
+    tree_node_t *a = n->parent;
+    while (a && a->fd < 0) a = a->parent;
+    int base = AT_FDCWD;
+    if (a) {
+        a->fd_users++;
+        base = a->fd;
+    }
+    pthread_mutex_unlock(&pool.fd_lock);
+
+    /* open the components below a, outermost first */
+    size_t depth = 0;
+    for (tree_node_t *t = n; t != a; t = t->parent) depth++;
+    tree_node_t **chain = malloc(depth * sizeof(*chain));
+    int fd = chain ? base : -1;
+    if (!chain) warn("malloc");
+    size_t k = depth;
+    for (tree_node_t *t = n; chain && t != a; t = t->parent) chain[--k] = t;
+    for (k = 0; chain && k < depth; k++) {
+        int nfd = openat(fd, chain[k]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        STATS_COUNT(CTR_SYS_OPEN, 1);
+        if (nfd == -1 && errno == EMFILE && node_release_fds()) {
+            nfd = openat(fd, chain[k]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            STATS_COUNT(CTR_SYS_OPEN, 1);
+        }
+        if (nfd == -1) warn(chain[k]->path);
+        if (fd != base) close(fd);
+        fd = nfd;
+        if (fd == -1) break;
+    }
+    int err = errno;
+    free(chain);
+
+    pthread_mutex_lock(&pool.fd_lock);
+    if (a) {
+        a->fd_users--;
+        node_fd_idle(a);
+    }
+    if (fd == -1) {
+        n->fd_failed = err != EMFILE;   /* EMFILE passes; say so each time */
+    } else if (n->fd < 0) {
+        node_fd_set(n, fd);     /* kept for n's other children */
+    } else {
+        close(fd);              /* another child reopened it first */
+        fd = n->fd;
+    }
+    if (fd >= 0) n->fd_users++;
+    pthread_mutex_unlock(&pool.fd_lock);
+    errno = err;
+    return fd;
+}
+
+/* Gives back node_child_fd()'s fd; opened: one more child is done with it. */
+static void node_fd_put(tree_node_t *n, int fd, int opened) {
+    pthread_mutex_lock(&pool.fd_lock);
+    if (fd >= 0) n->fd_users--;
+    if (opened) n->unloaded--;
+    node_fd_idle(n);
+    pthread_mutex_unlock(&pool.fd_lock);
+}
+
+static void deque_push(work_deque_t *q, tree_node_t *n) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == q->cap) {
+        size_t ncap = q->cap ? q->cap * 2 : 64;
+        tree_node_t **nb = malloc(ncap * sizeof(*nb));
+        if (!nb) {
+            /* leave it to the printer, which loads unclaimed nodes itself */
+            pthread_mutex_unlock(&q->lock);
+            node_unref(n);
+            return;
+        }
+        for (size_t i = q->head; i < q->tail; i++)
+            nb[i - q->head] = q->buf[i % q->cap];
+        free(q->buf);
+        q->buf = nb;
+        q->tail -= q->head;
+        q->head = 0;
+        q->cap = ncap;
+    }
+    q->buf[q->tail % q->cap] = n;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+
+    atomic_fetch_add(&pool.queued, 1);
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_signal(&pool.work_cv);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static tree_node_t *deque_take(work_deque_t *q, int from_top) {
+    tree_node_t *n = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != q->head) {
+        if (from_top)
+            n = q->buf[q->head++ % q->cap];
+        else
+            n = q->buf[--q->tail % q->cap];
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (n) atomic_fetch_sub(&pool.queued, 1);
+    return n;
+}
+
+/* Loads a claimed node and queues its subdirectories on deque self.
+ * A reader that runs out of descriptors hands the node back unloaded
+ * (only the printer retries it), so read-ahead never costs a listing. */
+static void node_load(tree_node_t *n, int self) {
+    atomic_fetch_add(&pool.inflight, 1);
+    strbuf_t *saved_sink = warn_sink;
+    warn_sink = &n->errors;
+
+    /* once the walk is stopped, nodes are only passed through */
+    int stopped = atomic_load(&walk_stopped);
+    int parent_fd = n->parent && !stopped ? node_child_fd(n->parent) : AT_FDCWD;
+    n->ok = !stopped && parent_fd != -1 &&
+            load_dir(parent_fd, n->name, n->path, &n->dir) == 0;
+    int defer = !n->ok && !stopped && errno == EMFILE && self < pool.nworkers;
+    if (n->parent) node_fd_put(n->parent, stopped ? -1 : parent_fd, !defer);
+    if (defer) {
+        n->errors.len = 0;
+        warn_sink = saved_sink;
+        atomic_fetch_sub(&pool.inflight, 1);
+        pthread_mutex_lock(&pool.lock);
+        atomic_store(&n->state, NODE_PENDING);
+        pthread_cond_broadcast(&pool.done_cv);
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    if (n->ok && !n->parent && opts.one_fs) {
+        struct stat st;
+        if (fstat(dirfd(n->dir.dirp), &st) == 0) n->root_dev = st.st_dev;
+    }
+    if (n->ok && opts.recursive) {
+        size_t ndirs = 0;
+        for (size_t i = 0; i < n->dir.count; i++)
+            if (is_subdir_entry(&n->dir.ents[i], n->root_dev)) ndirs++;
+        if (ndirs > 0)
+            n->children = malloc(ndirs * sizeof(*n->children));
+        if (ndirs > 0 && !n->children)
+            warn("malloc");
+        for (size_t i = 0; n->children && i < n->dir.count; i++) {
+            if (!is_subdir_entry(&n->dir.ents[i], n->root_dev)) continue;
+            char *child_path = join_path(n->path, n->dir.ents[i].name);
+            tree_node_t *c = child_path ?
+                node_new(child_path, strlen(child_path) - n->dir.ents[i].name_len, n) : NULL;
+            if (!c) {
+                free(child_path);
+                warn("malloc");
+                continue;
+            }
+            n->children[n->nchildren++] = c;
+        }
+        if (n->nchildren > 0) {
+            /* the children only need the descriptor, not the DIR's buffer;
+             * -1 still works: it is reopened on demand */
+            int fd = fcntl(dirfd(n->dir.dirp), F_DUPFD_CLOEXEC, 0);
+            if (fd == -1 && errno == EMFILE && node_release_fds())
+                fd = fcntl(dirfd(n->dir.dirp), F_DUPFD_CLOEXEC, 0);
+            pthread_mutex_lock(&pool.fd_lock);
+            n->unloaded = n->nchildren;
+            if (fd >= 0) node_fd_set(n, fd);
+            pthread_mutex_unlock(&pool.fd_lock);
+        }
+        /* push in reverse so the first child is popped first */
+        for (size_t i = n->nchildren; i-- > 0;)
+            deque_push(&pool.deques[self], n->children[i]);
+    }
+    if (n->dir.dirp) {
+        closedir(n->dir.dirp);
+        n->dir.dirp = NULL;
+    }
+
+    warn_sink = saved_sink;
+    pthread_mutex_lock(&pool.lock);
+    atomic_store(&n->state, NODE_DONE);
+    pthread_cond_broadcast(&pool.done_cv);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static int node_claim(tree_node_t *n) {
+    int expected = NODE_PENDING;
+    return atomic_compare_exchange_strong(&n->state, &expected, NODE_CLAIMED);
+}
+
+static void *par_worker(void *arg) {
+    int self = (int)(intptr_t)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.shutdown &&
+               (atomic_load(&pool.queued) == 0 ||
+                atomic_load(&pool.inflight) >= PAR_MAX_INFLIGHT))
+            pthread_cond_wait(&pool.work_cv, &pool.lock);
+        int stop = pool.shutdown;
+        pthread_mutex_unlock(&pool.lock);
+        if (stop) break;
+
+        tree_node_t *n = deque_take(&pool.deques[self], 0);
+        for (int k = 1; !n && k <= pool.nworkers; k++)
+            n = deque_take(&pool.deques[(self + k) % (pool.nworkers + 1)], 1);
+        if (!n) continue;
+
+        if (node_claim(n))
+            node_load(n, self);
+        node_unref(n);
+    }
+    uring_release();
+    return NULL;
+}
+
+/* Printer side: waits for (or loads) n and prints it. */
+static void par_print_node(tree_node_t *n) {
+    int mine;
+    pthread_mutex_lock(&pool.lock);
+    while (!(mine = node_claim(n)) && atomic_load(&n->state) != NODE_DONE)
+        pthread_cond_wait(&pool.done_cv, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    if (mine) node_load(n, pool.nworkers);
+
+    if (n->errors.len > 0 && !atomic_load(&walk_stopped))
+        replay_errors(&n->errors);
+    if (n->ok) {
+        STATS_ENTER_DIR();
+        walk_emit(n->path, LS_DIR_BEGIN | LS_DIR_END | (n->dir.cached ? LS_DIR_CACHED : 0),
+                  n->dir.ents, n->dir.count);
+    }
+    free_dir(&n->dir);      /* the children were made at load time */
+}
+
+/* Prints root's tree in list_dir() order. The parent links are the
+ * stack; after a stop the children are still waited for and freed. */
+static void par_print_tree(tree_node_t *root) {
+    par_print_node(root);
+    for (tree_node_t *n = root; n;) {
+        if (n->next < n->nchildren) {
+            tree_node_t *c = n->children[n->next++];
+            walk_enter(c->path);
+            par_print_node(c);
+            n = c;
+            continue;
+        }
+
+        tree_node_t *up = n->parent;
+        if (n->ok) STATS_LEAVE_DIR();
+        atomic_fetch_sub(&pool.inflight, 1);
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.work_cv);
+        pthread_mutex_unlock(&pool.lock);
+        node_unref(n);
+        n = up;
+    }
+}
+
+static int par_pool_start(int nworkers) {
+    pool.nworkers = nworkers;
+    pool.shutdown = 0;
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.inflight, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cv, NULL);
+    pthread_cond_init(&pool.done_cv, NULL);
+
+    pool.deques = calloc((size_t)nworkers + 1, sizeof(work_deque_t));
+    pool.threads = calloc((size_t)nworkers, sizeof(pthread_t));
+    if (!pool.deques || !pool.threads) {
+        free(pool.deques);
+        free(pool.threads);
+        return -1;
+    }
+    for (int i = 0; i <= nworkers; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool.threads[i], NULL, par_worker, (void *)(intptr_t)i) != 0) {
+            pool.nworkers = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void par_pool_stop(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work_cv);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.nworkers; i++)
+        pthread_join(pool.threads[i], NULL);
+
+    /* every node has been printed by now; drop the stale queue slots */
+    int total = (int)(pool.deques ? pool.nworkers + 1 : 0);
+    for (int i = 0; i < total; i++) {
+        tree_node_t *n;
+        while ((n = deque_take(&pool.deques[i], 1)) != NULL)
+            node_unref(n);
+        free(pool.deques[i].buf);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(pool.threads);
+    pthread_cond_destroy(&pool.work_cv);
+    pthread_cond_destroy(&pool.done_cv);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+static void list_trees_parallel(const char *const *paths, size_t npaths) {
+    tree_node_t **roots = calloc(npaths, sizeof(*roots));
+    if (!roots) {
+        warn("calloc");
+        return;
+    }
+    for (size_t i = 0; i < npaths; i++) {
+        char *root_path = strdup(paths[i]);
+        roots[i] = root_path ? node_new(root_path, 0, NULL) : NULL;
+        if (!roots[i]) {
+            free(root_path);
+            warn("malloc");
+        }
+    }
+    /* the first root is never queued (the printer loads it itself); the
+     * rest sit on the printer's deque, where workers steal them in order */
+    for (size_t i = 0; i < npaths; i++) {
+        if (!roots[i]) continue;
+        if (i == 0)
+            atomic_store(&roots[i]->refs, 1);
+        else
+            deque_push(&pool.deques[pool.nworkers], roots[i]);
+    }
+    for (size_t i = 0; i < npaths; i++) {
+        walk_enter(paths[i]);
+        if (roots[i]) par_print_tree(roots[i]);
+    }
+    free(roots);
+}
+
+/* ---------- Public API ----------
+ * Every entry point runs under api_lock with the caller's options
+ * unpacked into opts; api_busy catches a callback calling back in.
+ */
+static pthread_mutex_t api_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int api_busy;
+
+static int api_lock_enter(void) {
+    if (api_busy) {
+        errno = EDEADLK;
+        return -1;
+    }
+    pthread_mutex_lock(&api_lock);
+    api_busy = 1;
+    return 0;
+}
+
+static void api_lock_leave(void) {
+    api_busy = 0;
+    pthread_mutex_unlock(&api_lock);
+}
+
+static int options_set(const ls_options_t *o) {
+    static const ls_options_t defaults;
+    if (!o) o = &defaults;
+    if (o->sort < LS_SORT_NAME || o->sort > LS_SORT_NONE ||
+        (o->fields & ~(LS_FIELD_STAT | LS_FIELD_SORTKEY | LS_FIELD_ALLSTAT)) || o->jobs < 0 || o->stat_jobs < 0 ||
+        o->uring_depth < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    opts.meta = o->fields;
+    opts.dont_sync = o->dont_sync;
+    opts.dirbuf_size = o->dirbuf_size;
+    opts.jobs = o->jobs;
+    opts.stat_jobs = o->stat_jobs;
+    opts.io_uring = o->io_uring;
+    opts.uring_depth = o->uring_depth ? o->uring_depth : 64;
+    opts.unsorted = o->sort == LS_SORT_NONE;
+    opts.all = o->all;
+    opts.sort_key = opts.unsorted ? SORT_NAME : o->sort;
+    opts.reverse = o->reverse;
+    opts.head = o->head;
+    opts.recursive = o->recursive;
+    opts.color = o->color;
+    opts.follow = o->follow;
+    opts.one_fs = o->one_file_system;
+    opts.on_error = o->on_error;
+    opts.error_arg = o->error_arg;
+    return 0;
+}
+
+static int api_enter(const ls_options_t *o) {
+    if (api_lock_enter() == -1) return -1;
+    if (options_set(o) == -1) {
+        api_lock_leave();
+        return -1;
+    }
+    return 0;
+}
+
+static void api_leave(void) {
+    uring_release();
+    api_lock_leave();
+}
+
+struct ls_dir {
+    dir_listing_t d;
+    size_t pos;
+};
+
+ls_dir_t *ls_opendirat(int dirfd, const char *name, const ls_options_t *opt) {
+    if (api_enter(opt) == -1) return NULL;
+    ls_dir_t *d = malloc(sizeof(*d));
+    if (!d) {
+        warn("malloc");
+    } else if (load_dir(dirfd, name, name, &d->d) == -1) {
+        int saved = errno;
+        free(d);
+        d = NULL;
+        errno = saved;
+    } else {
+        d->pos = 0;
+    }
+    api_leave();
+    return d;
+}
+
+ls_dir_t *ls_opendir(const char *path, const ls_options_t *opt) {
+    return ls_opendirat(AT_FDCWD, path, opt);
+}
+
+const ls_entry_t *ls_readdir(ls_dir_t *d) {
+    return d->pos < d->d.count ? &d->d.ents[d->pos++] : NULL;
+}
+
+const ls_entry_t *ls_dir_entries(const ls_dir_t *d, size_t *count) {
+    *count = d->d.count;
+    return d->d.ents;
+}
+
+int ls_dir_fd(const ls_dir_t *d) {
+    return dirfd(d->d.dirp);
+}
+
+void ls_closedir(ls_dir_t *d) {
+    if (!d) return;
+    free_dir(&d->d);
+    free(d);
+}
+
+/* Drops what the -R walker keeps between paths. */
+static void walk_free(void) {
+    free(walk.frames);
+    free(walk.path);
+    free(visited.slots);
+    memset(&walk, 0, sizeof(walk));
+    memset(&visited, 0, sizeof(visited));
+}
+
+int ls_walk(const char *const *paths, size_t npaths, const ls_options_t *opt,
+            const ls_walk_ops_t *ops) {
+    static const ls_walk_ops_t no_ops;
+    if (api_enter(opt) == -1) return -1;
+    walk_ops = ops ? ops : &no_ops;
+    walk_entered = 0;
+    walk_result = 0;
+    atomic_store(&walk_stopped, 0);
+
+    /* Read ahead for recursive walks with jobs, and across several paths
+     * (which may sit on different servers) even without; otherwise the
+     * walk stays on the bounded-memory serial walker. Streaming hands
+     * entries over as it reads, so there is nothing to read ahead; when
+     * following links the first path handed over must be the one that
+     * lists a directory, so loads cannot race for the visited set.
+     */
+    int jobs = opts.jobs;
+    if (jobs == 0 && npaths > 1)
+        jobs = npaths - 1 < ARG_JOBS ? (int)npaths - 1 : ARG_JOBS;
+    int parallel = (opts.recursive ? opts.jobs > 0 && !opts.follow : npaths > 1) &&
+                   !opts.unsorted && par_pool_start(jobs) == 0;
+
+    if (parallel) {
+        list_trees_parallel(paths, npaths);
+        par_pool_stop();
+    } else {
+        for (size_t i = 0; i < npaths && walk_enter(paths[i]) == 0; ++i)
+            list_dir(AT_FDCWD, paths[i], paths[i]);
+    }
+
+    walk_free();
+    int rc = walk_result;
+    walk_ops = NULL;
+    api_leave();
+    return rc;
+}
+
+void ls_cache_open(const char *snapshot, const char *save_as, int changed_only) {
+    if (api_lock_enter() == -1) return;
+    if (!dcache.enabled) dcache_open(snapshot, save_as, changed_only);
+    api_lock_leave();
+}
+
+void ls_cache_close(void) {
+    if (api_lock_enter() == -1) return;
+    dcache_close();
+    api_lock_leave();
+}
+
+void ls_colors_load(const char *spec) {
+    if (api_lock_enter() == -1) return;
+    color_db_free();
+    color_db_init(spec);
+    api_lock_leave();
+}
+
+const char *ls_color(unsigned char color, size_t *len) {
+    const color_seq_t *c = &colors.seqs[color];
+    *len = c->len;
+    return c->len ? c->seq : NULL;
+}
+
+const char *ls_color_reset(size_t *len) {
+    *len = colors.reset.len;
+    return colors.reset.seq;
+}
+
+void ls_colors_free(void) {
+    if (api_lock_enter() == -1) return;
+    color_db_free();
+    api_lock_leave();
+}
@@ -0,0 +1,140 @@
+/* libls: the directory reader behind ls, as a library.
+ *
+ * Two ways in. The iterator (ls_opendir) loads one directory, sorted,
+ * and hands its entries back one at a time. The walk (ls_walk) lists one
+ * or more paths, optionally recursively, with read-ahead threads, and
+ * calls back with each directory's entries in the order ls prints them;
+ * with LS_SORT_NONE entries stream out in batches as they are read.
+ *
+ * Options are run-wide: the library keeps one set for the whole process,
+ * so calls are serialized on a single lock. Callbacks run on the calling
+ * thread; calling back into the library from one fails with EDEADLK.
+ * Errors about individual directories and entries do not stop a listing,
+ * they are handed to on_error (stderr if it is NULL).
+ */
+#ifndef LIBLS_H
+#define LIBLS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define LS_API __attribute__((visibility("default")))
+
+/* One directory entry. Strings live with the listing they came from. */
+typedef struct ls_entry {
+    const char *name;
+    struct stat st;             /* only what `fields` asked for is filled */
+    int is_link;
+    const char *link_target;    /* NULL unless symlink and LS_FIELD_STAT */
+    unsigned int name_len;
+    unsigned char ext_off;      /* 1 + offset of the last '.', 0 if none */
+    unsigned char d_type;       /* from the directory record */
+    unsigned char color;        /* index for ls_color(), if color is set */
+} ls_entry_t;
+
+/* Metadata to fetch for each entry (ls_options_t.fields).
+ *   LS_FIELD_TYPE:    file type plus the executable bits; d_type is
+ *                     trusted for everything except regular files.
+ *   LS_FIELD_STAT:    lstat() (stat() under follow) plus symlink targets;
+ *                     statx() is asked only for what ls -l prints.
+ *   LS_FIELD_SORTKEY: size and mtime of every entry; added by itself
+ *                     for LS_SORT_TIME and LS_SORT_SIZE.
+ *   LS_FIELD_ALLSTAT: with LS_FIELD_STAT, every struct stat field,
+ *                     st_ino and st_blocks included.
+ */
+enum {
+    LS_FIELD_TYPE = 0, LS_FIELD_STAT = 1 << 0, LS_FIELD_SORTKEY = 1 << 1,
+    LS_FIELD_ALLSTAT = 1 << 2
+};
+
+/* Orders (ls_options_t.sort). LS_SORT_NONE keeps directory order. */
+enum { LS_SORT_NAME, LS_SORT_TIME, LS_SORT_SIZE, LS_SORT_EXT, LS_SORT_NONE };
+
+typedef struct {
+    int fields;             /* LS_FIELD_* */
+    int sort;               /* LS_SORT_*: name by default */
+    int reverse;
+    int all;                /* include names starting with '.' */
+    size_t head;            /* only the first K entries in sort order, 0 = all */
+    int recursive;          /* ls_walk(): descend into subdirectories */
+    int follow;             /* stat link targets; descend into linked directories */
+    int one_file_system;    /* recursive walks stay on each path's device */
+    int color;              /* classify entries for ls_color() */
+    int jobs;               /* reader threads for recursive walks, 0 = serial */
+    int stat_jobs;          /* stat threads per huge directory */
+    int io_uring;           /* batch statx through io_uring if built in */
+    int uring_depth;        /* requests in flight per ring, 0 = 64 */
+    size_t dirbuf_size;     /* raw getdents64 buffer, 0 = readdir() */
+    int dont_sync;          /* accept cached attributes (statx) */
+    void (*on_error)(const char *msg, void *arg);
+    void *error_arg;
+} ls_options_t;
+
+/* ---------- Iterator ---------- */
+typedef struct ls_dir ls_dir_t;
+
+/* Load a whole directory; NULL (errno set, already reported) on error. */
+LS_API ls_dir_t *ls_opendir(const char *path, const ls_options_t *opt);
+LS_API ls_dir_t *ls_opendirat(int dirfd, const char *name, const ls_options_t *opt);
+/* Next entry, or NULL after the last one. */
+LS_API const ls_entry_t *ls_readdir(ls_dir_t *d);
+/* All entries at once. */
+LS_API const ls_entry_t *ls_dir_entries(const ls_dir_t *d, size_t *count);
+/* The open directory, for *at() calls on its entries. */
+LS_API int ls_dir_fd(const ls_dir_t *d);
+LS_API void ls_closedir(ls_dir_t *d);
+
+/* ---------- Walk ---------- */
+enum {
+    LS_DIR_BEGIN  = 1 << 0,     /* first call for this directory */
+    LS_DIR_END    = 1 << 1,     /* last call for this directory */
+    LS_DIR_CACHED = 1 << 2,     /* unchanged since the ls_cache_open() snapshot */
+};
+
+typedef struct {
+    const char *path;           /* display path */
+    unsigned flags;             /* LS_DIR_* */
+} ls_dir_info_t;
+
+/* A sorted directory arrives in one BEGIN|END call. A streamed one
+ * (LS_SORT_NONE) gets a BEGIN call with no entries as soon as it is
+ * open, then its batches, END on the last; batch strings are only valid
+ * during the call. A nonzero return from either callback ends the walk
+ * and is what ls_walk() returns.
+ */
+typedef struct {
+    /* before each directory's entries are delivered (the parallel and
+     * multi-path walks have already read it by then); index counts
+     * from 0 per walk */
+    int (*enter)(const char *path, size_t index, void *arg);
+    int (*entries)(const ls_dir_info_t *dir, const ls_entry_t *ents, size_t count,
+                   void *arg);
+    void *arg;
+} ls_walk_ops_t;
+
+/* Lists each path in turn (paths that fail are reported and skipped).
+ * Several paths are read concurrently. Returns 0, a callback's nonzero
+ * value, or -1 with errno set if the walk could not start. */
+LS_API int ls_walk(const char *const *paths, size_t npaths, const ls_options_t *opt,
+                   const ls_walk_ops_t *ops);
+
+/* ---------- Directory cache ----------
+ * Reuses listings of unchanged directories from the snapshot file, and
+ * writes this run's listings to save_as (may be NULL) at ls_cache_close().
+ * With changed_only, cached directories are flagged but not revalidated.
+ */
+LS_API void ls_cache_open(const char *snapshot, const char *save_as, int changed_only);
+LS_API void ls_cache_close(void);
+
+/* ---------- Colors ----------
+ * An LS_COLORS-style spec on top of the built-in type colors; NULL or ""
+ * keeps the built-in extension colors too.
+ */
+LS_API void ls_colors_load(const char *spec);
+/* Escape sequence for an entry's color, NULL if it has none. */
+LS_API const char *ls_color(unsigned char color, size_t *len);
+/* Sequence to write after a colored name. */
+LS_API const char *ls_color_reset(size_t *len);
+LS_API void ls_colors_free(void);
+
+#endif
@@ -2,7 +2,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -11,113 +10,141 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <errno.h>
-#include <limits.h>
-#include <linux/limits.h>   // for PATH_MAX
 #include <getopt.h>
 #include <ctype.h>
+#include <stdint.h>
 
-/* ---------- ANSI COLOR CODES ---------- */
-#define COLOR_RESET   "\033[0m"
-#define COLOR_BLUE    "\033[1;34m"
-#define COLOR_GREEN   "\033[1;32m"
-#define COLOR_RED     "\033[1;31m"
-#define COLOR_MAGENTA "\033[1;35m"
-#define COLOR_REVERSE "\033[7m"
+#include "libls.h"
+#include "ls_stats.h"
 
-/* ---------- STRUCT DEFINITION ---------- */
+/* ---------- Entries (from libls) ---------- */
+typedef ls_entry_t entry_t;
+
+/* ---------- Output formats (--format) ---------- */
+enum { FMT_TEXT, FMT_NDJSON, FMT_BINARY };
+
+/* ---------- Run-wide options (set once in main) ----------
+ * What decides which entries are read goes to libls in opts.list; the
+ * rest is how they are printed.
+ */
 typedef struct {
-    char *name;
-    struct stat st;
-    int is_link;
-    char link_target[PATH_MAX];
-} entry_t;
-
-/* ---------- PROTOTYPES ---------- */
-static void list_dir(const char *path, int mode, int recursive);
-static void join_path(const char *parent, const char *child, char *out, size_t outlen);
-static void print_long_listing(entry_t *ents, size_t count);
-static void print_columns(entry_t *ents, size_t count);
-static void print_horizontal(entry_t *ents, size_t count);
-static int cmp_entries(const void *a, const void *b);
-static void build_perm_string(mode_t m, char *out);
-static void print_with_color(const char *name, const struct stat *st);
-static entry_t *read_dir_entries(const char *path, size_t *out_count);
-
-/* ---------- Helper: read directory ---------- */
-static entry_t *read_dir_entries(const char *path, size_t *out_count) {
-    DIR *dirp = opendir(path);
-    if (!dirp) {
-        perror(path);
-        return NULL;
-    }
-
-    size_t cap = 64, count = 0;
-    entry_t *arr = malloc(cap * sizeof(entry_t));
-    if (!arr) {
-        perror("malloc");
-        closedir(dirp);
-        return NULL;
-    }
-
-    struct dirent *dp;
-    while ((dp = readdir(dirp)) != NULL) {
-        if (dp->d_name[0] == '.')
-            continue; // skip hidden files
-
-        if (count == cap) {
-            cap *= 2;
-            entry_t *tmp = realloc(arr, cap * sizeof(entry_t));
-            if (!tmp) {
-                perror("realloc");
-                for (size_t k = 0; k < count; ++k) free(arr[k].name);
-                free(arr);
-                closedir(dirp);
-                return NULL;
-            }
-            arr = tmp;
-        }
+    ls_options_t list;  /* handed to ls_walk() */
+    int mode;           /* 0=-C, 1=-l, 2=-x, 3=-1 */
+    int unsorted;       /* -U/-f: stream entries in directory order */
+    size_t term_width;  /* columns for -C/-x, queried once in main() */
+    int format;         /* FMT_*: --format=ndjson|binary, text by default */
+    int stats;          /* --stats: phase timings and counters on stderr */
+    const char *cache;  /* --cache=FILE: reuse listings of unchanged directories */
+    const char *since;  /* --since=SNAPSHOT: list only directories changed since */
+} options_t;
 
-        arr[count].name = strdup(dp->d_name);
-        if (!arr[count].name) {
-            perror("strdup");
-            for (size_t k = 0; k < count; ++k) free(arr[k].name);
-            free(arr);
-            closedir(dirp);
-            return NULL;
-        }
-        arr[count].is_link = 0;
-        arr[count].link_target[0] = '\0';
+static options_t opts = { .list = { .uring_depth = 64 }, .term_width = 80 };
 
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, dp->d_name);
+/* ---------- Buffered output ----------
+ * All listing output goes through one append-only buffer that is handed
+ * to write(2) in large blocks. Padding is copied from a run of spaces and
+ * integers are formatted by hand, so the printers never go through stdio.
+ * After a write error further output is dropped and main() exits non-zero.
+ */
+#define OUT_BUF_SIZE (1 << 16)
 
-        if (lstat(fullpath, &arr[count].st) == -1) {
-            /* on lstat failure, print error and continue (skip this entry) */
-            perror(fullpath);
-            free(arr[count].name);
-            continue;
+static struct {
+    char buf[OUT_BUF_SIZE];
+    size_t len;
+    int failed;
+} out;
+
+static const char out_spaces_run[] =
+    "                                                                "
+    "                                                                ";
+
+static void out_raw(const char *s, size_t n) {
+    while (n > 0 && !out.failed) {
+        STATS_START(t0);
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        STATS_STOP(PH_WRITE, t0);
+        STATS_COUNT(CTR_SYS_WRITE, 1);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            out.failed = 1;
+            break;
         }
+        STATS_COUNT(CTR_BYTES, (unsigned long long)w);
+        s += w;
+        n -= (size_t)w;
+    }
+}
+
+static void out_flush(void) {
+    out_raw(out.buf, out.len);
+    out.len = 0;
+}
 
-        if (S_ISLNK(arr[count].st.st_mode)) {
-            arr[count].is_link = 1;
-            ssize_t len = readlink(fullpath, arr[count].link_target,
-                                   sizeof(arr[count].link_target) - 1);
-            if (len >= 0)
-                arr[count].link_target[len] = '\0';
+static void out_write(const char *s, size_t n) {
+    if (n > sizeof(out.buf) - out.len) {
+        out_flush();
+        if (n > sizeof(out.buf)) {
+            /* too big to buffer: hand it straight to the kernel */
+            out_raw(s, n);
+            return;
         }
-        count++;
     }
+    memcpy(out.buf + out.len, s, n);
+    out.len += n;
+}
+
+static void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+static void out_char(char c) {
+    if (out.len == sizeof(out.buf)) out_flush();
+    out.buf[out.len++] = c;
+}
+
+static void out_spaces(size_t n) {
+    while (n > 0) {
+        size_t chunk = n < sizeof(out_spaces_run) - 1 ? n : sizeof(out_spaces_run) - 1;
+        out_write(out_spaces_run, chunk);
+        n -= chunk;
+    }
+}
+
+/* Right-aligns v in a field of at least width characters, like "%*lld". */
+static void out_int(long long v, int width) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    if ((size_t)width > len) out_spaces((size_t)width - len);
+    out_write(p, len);
+}
 
-    closedir(dirp);
-    *out_count = count;
-    return arr;
+static void out_uint(unsigned long long u) {
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    out_write(p, (size_t)(tmp + sizeof(tmp) - p));
 }
 
-/* ---------- Comparator for qsort ---------- */
-static int cmp_entries(const void *a, const void *b) {
-    const entry_t *ea = a;
-    const entry_t *eb = b;
-    return strcmp(ea->name, eb->name);
+/* Errors from libls go to stderr; flush pending listing output first so
+ * the two streams stay in order on a terminal. Any error means something
+ * was left out, so main() exits non-zero. */
+static int listing_errors;
+
+static void report_error(const char *msg, void *arg) {
+    (void)arg;
+    out_flush();
+    fprintf(stderr, "%s\n", msg);
+    listing_errors = 1;
 }
 
 /* ---------- Helper: build permissions ---------- */
@@ -142,226 +169,922 @@ static void build_perm_string(mode_t m, char *out) {
     if (m & S_IXOTH) out[9] = 'x';
 }
 
-/* ---------- Color helpers ---------- */
-static int has_archive_ext(const char *name) {
-    if (!name) return 0;
-    const char *dot = strrchr(name, '.');
-    if (!dot) return 0;
-    return (strcmp(dot, ".tar") == 0 ||
-            strcmp(dot, ".gz")  == 0 ||
-            strcmp(dot, ".zip") == 0);
-}
-
-static void print_with_color(const char *name, const struct stat *st) {
-    const char *color = COLOR_RESET;
-
-    if (S_ISDIR(st->st_mode)) {
-        color = COLOR_BLUE;
-    } else if (S_ISLNK(st->st_mode)) {
-        color = COLOR_MAGENTA;
-    } else if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) ||
-               S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode)) {
-        color = COLOR_REVERSE;
-    } else if (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
-        color = COLOR_GREEN;
-    } else if (has_archive_ext(name)) {
-        color = COLOR_RED;
-    } else {
-        color = COLOR_RESET;
+/* ---------- Colored names ---------- */
+static void print_with_color(const entry_t *e) {
+    size_t len, reset_len;
+    const char *seq = opts.list.color ? ls_color(e->color, &len) : NULL;
+    if (!seq) {
+        out_write(e->name, e->name_len);
+        return;
+    }
+    const char *reset = ls_color_reset(&reset_len);
+    out_write(seq, len);
+    out_write(e->name, e->name_len);
+    out_write(reset, reset_len);
+}
+
+/* ---------- Owner/group name cache ----------
+ * getpwuid()/getgrgid() may go to the network (LDAP/SSSD), and almost
+ * every row in a listing shares a few owners. Results are kept for the
+ * whole run in small open-addressing tables, already padded to the
+ * "%-8s" width the long listing prints.
+ */
+typedef struct {
+    unsigned int id;
+    int used;
+    char *label;
+} id_slot_t;
+
+typedef struct {
+    id_slot_t *slots;
+    size_t cap, count;     /* cap is a power of two */
+} id_cache_t;
+
+static id_cache_t user_cache, group_cache;
+
+static size_t id_hash(unsigned int id, size_t cap) {
+    return (size_t)((id * 2654435761u) & (cap - 1));
+}
+
+static id_slot_t *id_cache_find(id_cache_t *c, unsigned int id) {
+    if (c->count * 2 >= c->cap) {
+        size_t ncap = c->cap ? c->cap * 2 : 64;
+        id_slot_t *ns = calloc(ncap, sizeof(id_slot_t));
+        if (!ns) return NULL;
+        for (size_t i = 0; i < c->cap; i++) {
+            if (!c->slots[i].used) continue;
+            size_t h = id_hash(c->slots[i].id, ncap);
+            while (ns[h].used) h = (h + 1) & (ncap - 1);
+            ns[h] = c->slots[i];
+        }
+        free(c->slots);
+        c->slots = ns;
+        c->cap = ncap;
+    }
+    size_t h = id_hash(id, c->cap);
+    while (c->slots[h].used && c->slots[h].id != id)
+        h = (h + 1) & (c->cap - 1);
+    return &c->slots[h];
+}
+
+static char *make_id_label(const char *name) {
+    char *label = NULL;
+    if (asprintf(&label, "%-8s", name) < 0) return NULL;
+    return label;
+}
+
+static const char *user_label(uid_t uid) {
+    id_slot_t *slot = id_cache_find(&user_cache, (unsigned int)uid);
+    if (slot && slot->used) {
+        STATS_COUNT(CTR_UID_HIT, 1);
+        return slot->label;
+    }
+    STATS_COUNT(CTR_UID_MISS, 1);
+
+    STATS_START(t0);
+    struct passwd *pw = getpwuid(uid);
+    char *label = make_id_label(pw ? pw->pw_name : "unknown");
+    STATS_STOP(PH_NSS, t0);
+    if (!slot || !label) {
+        free(label);
+        return "unknown ";
+    }
+    slot->id = (unsigned int)uid;
+    slot->used = 1;
+    slot->label = label;
+    user_cache.count++;
+    return label;
+}
+
+static const char *group_label(gid_t gid) {
+    id_slot_t *slot = id_cache_find(&group_cache, (unsigned int)gid);
+    if (slot && slot->used) {
+        STATS_COUNT(CTR_GID_HIT, 1);
+        return slot->label;
+    }
+    STATS_COUNT(CTR_GID_MISS, 1);
+
+    STATS_START(t0);
+    struct group *gr = getgrgid(gid);
+    char *label = make_id_label(gr ? gr->gr_name : "unknown");
+    STATS_STOP(PH_NSS, t0);
+    if (!slot || !label) {
+        free(label);
+        return "unknown ";
+    }
+    slot->id = (unsigned int)gid;
+    slot->used = 1;
+    slot->label = label;
+    group_cache.count++;
+    return label;
+}
+
+static void id_cache_free(id_cache_t *c) {
+    for (size_t i = 0; i < c->cap; i++)
+        if (c->slots[i].used) free(c->slots[i].label);
+    free(c->slots);
+    c->slots = NULL;
+    c->cap = c->count = 0;
+}
+
+/* ---------- Time formatting cache ----------
+ * Rows in one directory tend to share a date, often the same minute.
+ * Formatted "%b %e %H:%M" strings are cached per minute in a small
+ * direct-mapped table. On a miss the fields are computed by arithmetic
+ * from the UTC offset, which is fetched with localtime_r() once per
+ * 15-minute bucket (modern zones only change offset on such a
+ * boundary). strftime() is not needed: we never call setlocale(), so
+ * %b is always the C-locale month abbreviation.
+ */
+#define TIME_LABEL_LEN 12       /* "Mon dd HH:MM" */
+#define TIME_CACHE_SIZE 256
+#define TZ_CACHE_SIZE 64
+
+typedef struct {
+    long long minute;
+    int valid;
+    char label[TIME_LABEL_LEN + 1];
+} time_slot_t;
+
+typedef struct {
+    long long bucket;
+    int valid, mixed;
+    long offset;
+} tz_slot_t;
+
+static time_slot_t time_cache[TIME_CACHE_SIZE];
+static tz_slot_t tz_cache[TZ_CACHE_SIZE];
+
+static long long floor_div(long long a, long long b) {
+    long long q = a / b;
+    if ((a % b != 0) && ((a < 0) != (b < 0))) q--;
+    return q;
+}
+
+/* UTC offset in effect at t; returns -1 if localtime_r() cannot map t.
+ * A bucket whose two ends disagree (historic LMT switches happen at odd
+ * seconds) is marked mixed and always answered by localtime_r().
+ */
+static int utc_offset_at(time_t t, long *offset) {
+    long long bucket = floor_div((long long)t, 900);
+    tz_slot_t *slot = &tz_cache[(unsigned long long)bucket % TZ_CACHE_SIZE];
+    if (!slot->valid || slot->bucket != bucket) {
+        struct tm first, last;
+        time_t lo = (time_t)(bucket * 900), hi = lo + 899;
+        if (!localtime_r(&lo, &first) || !localtime_r(&hi, &last)) {
+            slot->valid = 0;
+            struct tm tm_info;
+            if (!localtime_r(&t, &tm_info)) return -1;
+            *offset = tm_info.tm_gmtoff;
+            return 0;
+        }
+        slot->bucket = bucket;
+        slot->offset = first.tm_gmtoff;
+        slot->mixed = (first.tm_gmtoff != last.tm_gmtoff);
+        slot->valid = 1;
+    }
+    if (slot->mixed) {
+        struct tm tm_info;
+        if (!localtime_r(&t, &tm_info)) return -1;
+        *offset = tm_info.tm_gmtoff;
+        return 0;
+    }
+    *offset = slot->offset;
+    return 0;
+}
+
+/* days since 1970-01-01 -> civil date (proleptic Gregorian) */
+static void civil_from_days(long long z, int *month, int *day) {
+    z += 719468;
+    long long era = floor_div(z, 146097);
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+}
+
+static const char *format_mtime(time_t t) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    long long minute = floor_div((long long)t, 60);
+    time_slot_t *slot = &time_cache[(unsigned long long)minute % TIME_CACHE_SIZE];
+    if (slot->valid && slot->minute == minute) {
+        STATS_COUNT(CTR_TIME_HIT, 1);
+        return slot->label;
     }
+    STATS_COUNT(CTR_TIME_MISS, 1);
 
-    printf("%s%s%s", color, name, COLOR_RESET);
+    long offset;
+    if (utc_offset_at(t, &offset) == -1)
+        return "??? ?? ??:??";
+
+    long long local = (long long)t + offset;
+    long long days = floor_div(local, 86400);
+    long long secs = local - days * 86400;
+    int month, day;
+    civil_from_days(days, &month, &day);
+    int hour = (int)(secs / 3600);
+    int min = (int)(secs / 60 % 60);
+
+    char *o = slot->label;
+    memcpy(o, months + (month - 1) * 3, 3);
+    o[3] = ' ';
+    o[4] = day >= 10 ? (char)('0' + day / 10) : ' ';
+    o[5] = (char)('0' + day % 10);
+    o[6] = ' ';
+    o[7] = (char)('0' + hour / 10);
+    o[8] = (char)('0' + hour % 10);
+    o[9] = ':';
+    o[10] = (char)('0' + min / 10);
+    o[11] = (char)('0' + min % 10);
+    o[12] = '\0';
+    slot->minute = minute;
+    slot->valid = 1;
+    return slot->label;
 }
 
 /* ---------- Long listing ---------- */
-static void print_long_listing(entry_t *ents, size_t count) {
+static void print_long_listing(const entry_t *ents, size_t count) {
     for (size_t i = 0; i < count; i++) {
         char perm[11];
         build_perm_string(ents[i].st.st_mode, perm);
 
-        struct passwd *pw = getpwuid(ents[i].st.st_uid);
-        struct group  *gr = getgrgid(ents[i].st.st_gid);
-
-        char timebuf[64];
-        struct tm *tm_info = localtime(&ents[i].st.st_mtime);
-        if (tm_info)
-            strftime(timebuf, sizeof(timebuf), "%b %e %H:%M", tm_info);
-        else
-            strncpy(timebuf, "??? ?? ??:??", sizeof(timebuf));
-
-        printf("%s %3ld %-8s %-8s %8lld %s ",
-               perm,
-               (long)ents[i].st.st_nlink,
-               pw ? pw->pw_name : "unknown",
-               gr ? gr->gr_name : "unknown",
-               (long long)ents[i].st.st_size,
-               timebuf);
-
-        if (ents[i].is_link && ents[i].link_target[0]) {
-            print_with_color(ents[i].name, &ents[i].st);
-            printf(" -> %s\n", ents[i].link_target);
-        } else {
-            print_with_color(ents[i].name, &ents[i].st);
-            printf("\n");
+        out_write(perm, 10);
+        out_char(' ');
+        out_int((long long)ents[i].st.st_nlink, 3);
+        out_char(' ');
+        out_str(user_label(ents[i].st.st_uid));
+        out_char(' ');
+        out_str(group_label(ents[i].st.st_gid));
+        out_char(' ');
+        out_int((long long)ents[i].st.st_size, 8);
+        out_char(' ');
+        out_write(format_mtime(ents[i].st.st_mtime), TIME_LABEL_LEN);
+        out_char(' ');
+
+        print_with_color(&ents[i]);
+        if (ents[i].is_link && ents[i].link_target && ents[i].link_target[0]) {
+            out_write(" -> ", 4);
+            out_str(ents[i].link_target);
         }
+        out_char('\n');
     }
 }
 
-/* ---------- Down-then-across (default) ---------- */
-static void print_columns(entry_t *ents, size_t count) {
-    if (count == 0) return;
+/* ---------- Down-then-across (default) ----------
+ * Columns get individual widths, GNU style: we use the largest column
+ * count whose widths (plus two spaces between columns) fit the terminal,
+ * so one long name no longer forces a single column. A candidate layout
+ * is checked with range-maximum queries over name_len, answered from
+ * block maxima over 64 and 4096 entries; a check costs O(cols) plus
+ * O(count / 4096) instead of a pass over every name.
+ */
+#define COL_SEP       2
+#define MIN_COL_WIDTH (1 + COL_SEP)
+#define WBLK1 64
+#define WBLK2 4096
 
-    size_t max_len = 0;
+typedef struct {
+    const entry_t *ents;
+    size_t count;
+    unsigned int *max1;         /* max name_len per WBLK1 entries */
+    unsigned int *max2;         /* max name_len per WBLK2 entries */
+} width_index_t;
+
+static int width_index_init(width_index_t *wi, const entry_t *ents, size_t count) {
+    wi->ents = ents;
+    wi->count = count;
+    wi->max1 = calloc(count / WBLK1 + 1, sizeof(unsigned int));
+    wi->max2 = calloc(count / WBLK2 + 1, sizeof(unsigned int));
+    if (!wi->max1 || !wi->max2) {
+        free(wi->max1);
+        free(wi->max2);
+        return -1;
+    }
     for (size_t i = 0; i < count; i++) {
-        size_t len = strlen(ents[i].name);
-        if (len > max_len) max_len = len;
+        unsigned int len = ents[i].name_len;
+        if (len > wi->max1[i / WBLK1]) wi->max1[i / WBLK1] = len;
+        if (len > wi->max2[i / WBLK2]) wi->max2[i / WBLK2] = len;
     }
+    return 0;
+}
 
-    struct winsize ws;
-    size_t term_width = 80;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
-        term_width = ws.ws_col;
+/* Longest name in [lo, hi). */
+static unsigned int width_range_max(const width_index_t *wi, size_t lo, size_t hi) {
+    unsigned int m = 0;
+    while (lo < hi && lo % WBLK1 != 0) m = wi->ents[lo].name_len > m ? wi->ents[lo].name_len : m, lo++;
+    while (lo + WBLK1 <= hi && lo % WBLK2 != 0) m = wi->max1[lo / WBLK1] > m ? wi->max1[lo / WBLK1] : m, lo += WBLK1;
+    while (lo + WBLK2 <= hi) m = wi->max2[lo / WBLK2] > m ? wi->max2[lo / WBLK2] : m, lo += WBLK2;
+    while (lo + WBLK1 <= hi) m = wi->max1[lo / WBLK1] > m ? wi->max1[lo / WBLK1] : m, lo += WBLK1;
+    while (lo < hi) m = wi->ents[lo].name_len > m ? wi->ents[lo].name_len : m, lo++;
+    return m;
+}
 
-    size_t col_width = max_len + 2;
-    size_t cols = term_width / (col_width == 0 ? 1 : col_width);
-    if (cols < 1) cols = 1;
-    size_t rows = (count + cols - 1) / cols;
+/* Fills widths[] for a layout with `rows` rows; returns the number of
+ * columns, or 0 if the line would not fit in term_width. */
+static size_t fit_columns(const width_index_t *wi, size_t rows, size_t term_width,
+                          unsigned int *widths) {
+    size_t line = 0, cols = 0;
+    for (size_t lo = 0; lo < wi->count; lo += rows, cols++) {
+        size_t hi = lo + rows < wi->count ? lo + rows : wi->count;
+        unsigned int w = width_range_max(wi, lo, hi);
+        line += (cols ? COL_SEP : 0) + w;
+        if (line >= term_width) return 0;
+        if (widths) widths[cols] = w;
+    }
+    return cols;
+}
+
+static void print_columns(const entry_t *ents, size_t count) {
+    if (count == 0) return;
+
+    size_t term_width = opts.term_width;
+
+    size_t max_cols = term_width / MIN_COL_WIDTH;
+    if (max_cols > count) max_cols = count;
+    if (max_cols < 1) max_cols = 1;
+
+    width_index_t wi;
+    unsigned int *widths = malloc(max_cols * sizeof(unsigned int));
+    size_t rows = count, cols = 1;
+    if (widths && width_index_init(&wi, ents, count) == 0) {
+        /* most columns first; each column count maps to a row count */
+        for (size_t c = max_cols; c > 1; c--) {
+            size_t r = (count + c - 1) / c;
+            if (c < max_cols && r == (count + c) / (c + 1))
+                continue;       /* same rows as the layout just tried */
+            size_t got = fit_columns(&wi, r, term_width, widths);
+            if (got > 0) {
+                rows = r;
+                cols = got;
+                break;
+            }
+        }
+        free(wi.max1);
+        free(wi.max2);
+    }
+    if (cols == 1) {
+        /* one column: no padding needed, widths[] may be unavailable */
+        for (size_t i = 0; i < count; i++) {
+            print_with_color(&ents[i]);
+            out_char('\n');
+        }
+        free(widths);
+        return;
+    }
 
     for (size_t r = 0; r < rows; r++) {
         for (size_t c = 0; c < cols; c++) {
             size_t idx = c * rows + r;
-            if (idx >= count) continue;
+            if (idx >= count) break;
 
-            const char *n = ents[idx].name;
-            print_with_color(n, &ents[idx].st);
-            int pad = (int)col_width - (int)strlen(n);
-            if (pad < 0) pad = 0;
-            for (int p = 0; p < pad; ++p) putchar(' ');
+            print_with_color(&ents[idx]);
+            /* pad unless this is the last name on the line */
+            if (c + 1 < cols && idx + rows < count)
+                out_spaces(widths[c] - ents[idx].name_len + COL_SEP);
         }
-        putchar('\n');
+        out_char('\n');
     }
+    free(widths);
 }
 
 /* ---------- Horizontal (across) ---------- */
-static void print_horizontal(entry_t *ents, size_t count) {
+static void print_horizontal(const entry_t *ents, size_t count) {
     if (count == 0) return;
 
     size_t max_len = 0;
     for (size_t i = 0; i < count; i++) {
-        size_t len = strlen(ents[i].name);
-        if (len > max_len) max_len = len;
+        if (ents[i].name_len > max_len) max_len = ents[i].name_len;
     }
 
-    struct winsize ws;
-    size_t term_width = 80;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
-        term_width = ws.ws_col;
+    size_t term_width = opts.term_width;
 
     size_t col_width = max_len + 2;
     size_t current = 0;
 
     for (size_t i = 0; i < count; i++) {
-        const char *n = ents[i].name;
-        size_t len = strlen(n);
+        size_t len = ents[i].name_len;
         if (current + len + 1 > term_width) {
-            putchar('\n');
+            out_char('\n');
             current = 0;
         }
 
-        print_with_color(n, &ents[i].st);
+        print_with_color(&ents[i]);
         int pad = (int)col_width - (int)len;
         if (pad < 1) pad = 1;
-        for (int p = 0; p < pad; ++p) putchar(' ');
+        out_spaces((size_t)pad);
         current += len + pad;
     }
-    putchar('\n');
+    out_char('\n');
 }
 
-/* ---------- Path join helper ---------- */
-static void join_path(const char *parent, const char *child, char *out, size_t outlen) {
-    if (!parent || parent[0] == '\0') {
-        snprintf(out, outlen, "%s", child);
+/* ---------- One per line ----------
+ * Without color (stdout is not a terminal) each row is just the name and
+ * a newline, so the loop skips print_with_color() and its escapes.
+ */
+static void print_one_per_line(const entry_t *ents, size_t count) {
+    if (!opts.list.color) {
+        for (size_t i = 0; i < count; i++) {
+            out_write(ents[i].name, ents[i].name_len);
+            out_char('\n');
+        }
         return;
     }
-    size_t plen = strlen(parent);
-    if (parent[plen - 1] == '/') {
-        snprintf(out, outlen, "%s%s", parent, child);
-    } else {
-        snprintf(out, outlen, "%s/%s", parent, child);
+    for (size_t i = 0; i < count; i++) {
+        print_with_color(&ents[i]);
+        out_char('\n');
+    }
+}
+
+/* ---------- Machine-readable records (--format) ----------
+ * Raw struct stat fields, straight into the output buffer: no getpwuid(),
+ * no strftime(), no padding.
+ *
+ * ndjson: one object per entry,
+ *   {"dir":"..","name":"..","ino":N,"dev":N,"mode":N,"nlink":N,"uid":N,
+ *    "gid":N,"size":N,"blocks":N,"mtime":S,"mtime_nsec":NS[,"target":".."]}
+ *   with '"', '\\' and control characters escaped. A string that is not
+ *   valid UTF-8 is written one byte per character, bytes from 0x80 up as
+ *   \u0080-\u00ff, and flagged with "dir_bytes", "name_bytes" or
+ *   "target_bytes":true right after it; encoding it as Latin-1 gives the
+ *   original bytes back.
+ *
+ * binary: records in host byte order, each a u32 length of what follows
+ * and a u8 kind.
+ *   'D': the directory path; the entries after it belong to that directory.
+ *   'E': u64 ino, dev, nlink, size, blocks; u32 mode, uid, gid;
+ *        i64 mtime; u32 mtime_nsec; u32 name_len, target_len; name; target.
+ */
+#define REC_ENTRY_FIXED (5 * 8 + 3 * 4 + 8 + 4 + 2 * 4)
+
+/* Strict UTF-8: no overlong forms, surrogates or code points past U+10FFFF. */
+static int utf8_valid(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    for (size_t i = 0; i < len;) {
+        unsigned char c = s[i], lo = 0x80, hi = 0xbf;
+        size_t n;
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            if (c == 0xe0) lo = 0xa0;
+            if (c == 0xed) hi = 0x9f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            if (c == 0xf0) lo = 0x90;
+            if (c == 0xf4) hi = 0x8f;
+        } else {
+            return 0;
+        }
+        if (len - i <= n || s[i + 1] < lo || s[i + 1] > hi) return 0;
+        for (size_t k = 2; k <= n; k++)
+            if ((s[i + k] & 0xc0) != 0x80) return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+/* Writes s as a JSON string; bytes: one character per byte (!utf8_valid()). */
+static void out_json_str(const char *s, size_t len, int bytes) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    out_char('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || !bytes)) continue;
+        out_write(s + run, i - run);
+        run = i + 1;
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', (char)c };
+            out_write(esc, 2);
+        } else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            out_write(esc, 6);
+        }
+    }
+    out_write(s + run, len - run);
+    out_char('"');
+}
+
+static void print_records_ndjson(const entry_t *ents, size_t count, const char *dir) {
+    size_t dir_len = strlen(dir);
+    int dir_bytes = !utf8_valid(dir, dir_len);
+    for (size_t i = 0; i < count; i++) {
+        const struct stat *st = &ents[i].st;
+        out_write("{\"dir\":", 7);
+        out_json_str(dir, dir_len, dir_bytes);
+        if (dir_bytes) out_write(",\"dir_bytes\":true", 17);
+        int name_bytes = !utf8_valid(ents[i].name, ents[i].name_len);
+        out_write(",\"name\":", 8);
+        out_json_str(ents[i].name, ents[i].name_len, name_bytes);
+        if (name_bytes) out_write(",\"name_bytes\":true", 18);
+        out_write(",\"ino\":", 7);
+        out_uint((unsigned long long)st->st_ino);
+        out_write(",\"dev\":", 7);
+        out_uint((unsigned long long)st->st_dev);
+        out_write(",\"mode\":", 8);
+        out_uint((unsigned long long)st->st_mode);
+        out_write(",\"nlink\":", 9);
+        out_uint((unsigned long long)st->st_nlink);
+        out_write(",\"uid\":", 7);
+        out_uint((unsigned long long)st->st_uid);
+        out_write(",\"gid\":", 7);
+        out_uint((unsigned long long)st->st_gid);
+        out_write(",\"size\":", 8);
+        out_int((long long)st->st_size, 0);
+        out_write(",\"blocks\":", 10);
+        out_int((long long)st->st_blocks, 0);
+        out_write(",\"mtime\":", 9);
+        out_int((long long)st->st_mtim.tv_sec, 0);
+        out_write(",\"mtime_nsec\":", 14);
+        out_int((long long)st->st_mtim.tv_nsec, 0);
+        if (ents[i].link_target) {
+            out_write(",\"target\":", 10);
+            size_t target_len = strlen(ents[i].link_target);
+            int target_bytes = !utf8_valid(ents[i].link_target, target_len);
+            out_json_str(ents[i].link_target, target_len, target_bytes);
+            if (target_bytes) out_write(",\"target_bytes\":true", 20);
+        }
+        out_write("}\n", 2);
+    }
+}
+
+static void put_u32(char **p, uint32_t v) { memcpy(*p, &v, 4); *p += 4; }
+static void put_u64(char **p, uint64_t v) { memcpy(*p, &v, 8); *p += 8; }
+
+static void print_records_binary(const entry_t *ents, size_t count, const char *dir) {
+    char rec[4 + 1 + REC_ENTRY_FIXED];
+    uint32_t dir_len = (uint32_t)strlen(dir);
+    char *p = rec;
+
+    put_u32(&p, 1 + dir_len);
+    *p++ = 'D';
+    out_write(rec, (size_t)(p - rec));
+    out_write(dir, dir_len);
+
+    for (size_t i = 0; i < count; i++) {
+        const struct stat *st = &ents[i].st;
+        const char *target = ents[i].link_target;
+        uint32_t target_len = target ? (uint32_t)strlen(target) : 0;
+
+        p = rec;
+        put_u32(&p, 1 + REC_ENTRY_FIXED + ents[i].name_len + target_len);
+        *p++ = 'E';
+        put_u64(&p, (uint64_t)st->st_ino);
+        put_u64(&p, (uint64_t)st->st_dev);
+        put_u64(&p, (uint64_t)st->st_nlink);
+        put_u64(&p, (uint64_t)st->st_size);
+        put_u64(&p, (uint64_t)st->st_blocks);
+        put_u32(&p, (uint32_t)st->st_mode);
+        put_u32(&p, (uint32_t)st->st_uid);
+        put_u32(&p, (uint32_t)st->st_gid);
+        put_u64(&p, (uint64_t)(int64_t)st->st_mtim.tv_sec);
+        put_u32(&p, (uint32_t)st->st_mtim.tv_nsec);
+        put_u32(&p, ents[i].name_len);
+        put_u32(&p, target_len);
+
+        out_write(rec, (size_t)(p - rec));
+        out_write(ents[i].name, ents[i].name_len);
+        if (target_len) out_write(target, target_len);
     }
 }
 
-/* ---------- Main directory handling (recursive capable) ---------- */
-static void list_dir(const char *path, int mode, int recursive) {
-    size_t count = 0;
-    entry_t *arr = read_dir_entries(path, &count);
-    if (!arr) return;
+static void print_records(const entry_t *ents, size_t count, const char *dir) {
+    if (opts.format == FMT_NDJSON)
+        print_records_ndjson(ents, count, dir);
+    else
+        print_records_binary(ents, count, dir);
+}
 
-    /* sort alphabetically */
-    qsort(arr, count, sizeof(entry_t), cmp_entries);
+/* Directory header when recursive (ls -R shows "path:"); records carry
+ * their directory instead. */
+static void print_dir_header(const char *path, int recursive) {
+    if (recursive && opts.format == FMT_TEXT) {
+        out_str(path);
+        out_write(":\n", 2);
+    }
+}
+
+/* Blank line between two directory listings, as `ls -R` prints. Under
+ * --since most directories print nothing, so print_dir() adds it. */
+static void print_dir_separator(void) {
+    if (opts.format == FMT_TEXT && !opts.since) out_char('\n');
+}
 
-    /* Print directory header when recursive (ls -R shows "path:") */
-    if (recursive) {
-        printf("%s:\n", path);
+/* Prints one whole, sorted directory. */
+static void print_dir(const ls_dir_info_t *dir, const entry_t *ents, size_t count) {
+    int recursive = opts.list.recursive;
+    if (opts.since) {
+        /* --since: an unchanged directory is only walked through */
+        static int printed_any;
+        if (dir->flags & LS_DIR_CACHED) return;
+        if (printed_any++ && opts.format == FMT_TEXT) out_char('\n');
+        recursive = 1;      /* always say which directory changed */
     }
+    print_dir_header(dir->path, recursive);
 
     /* Use existing display logic */
-    if (mode == 1)
-        print_long_listing(arr, count);
-    else if (mode == 2)
-        print_horizontal(arr, count);
+    STATS_START(t0);
+    if (opts.format != FMT_TEXT) {
+        print_records(ents, count, dir->path);
+        STATS_STOP(PH_PRINT_RECORDS, t0);
+    } else if (opts.mode == 1) {
+        print_long_listing(ents, count);
+        STATS_STOP(PH_PRINT_LONG, t0);
+    } else if (opts.mode == 2) {
+        print_horizontal(ents, count);
+        STATS_STOP(PH_PRINT_ACROSS, t0);
+    } else if (opts.mode == 3) {
+        print_one_per_line(ents, count);
+        STATS_STOP(PH_PRINT_LINES, t0);
+    } else {
+        print_columns(ents, count);
+        STATS_STOP(PH_PRINT_COLUMNS, t0);
+    }
+}
+
+/* -U / -f: entries arrive in directory order, a batch at a time, and
+ * are printed as they come: -l rows or one name per line. */
+static void print_batch(const ls_dir_info_t *dir, const entry_t *ents, size_t count) {
+    if ((dir->flags & (LS_DIR_BEGIN | LS_DIR_END)) == LS_DIR_BEGIN) {
+        print_dir_header(dir->path, opts.list.recursive);
+        return;
+    }
+    STATS_START(t0);
+    if (opts.format != FMT_TEXT) {
+        print_records(ents, count, dir->path);
+        STATS_STOP(PH_PRINT_RECORDS, t0);
+    } else if (opts.mode == 1) {
+        print_long_listing(ents, count);
+        STATS_STOP(PH_PRINT_LONG, t0);
+    } else {
+        print_one_per_line(ents, count);
+        STATS_STOP(PH_PRINT_LINES, t0);
+    }
+    out_flush();    /* let `| head` see each batch right away */
+}
+
+/* ---------- libls walk callbacks ---------- */
+static int enter_dir(const char *path, size_t index, void *arg) {
+    (void)path;
+    (void)arg;
+    /* blank line before each directory but the first, as `ls -R` does */
+    if (index > 0) print_dir_separator();
+    return 0;
+}
+
+static int list_entries(const ls_dir_info_t *dir, const ls_entry_t *ents, size_t count,
+                        void *arg) {
+    (void)arg;
+    if (opts.unsorted)
+        print_batch(dir, ents, count);
     else
-        print_columns(arr, count);
-
-    /* If recursive, after listing current directory, recurse into subdirectories */
-    if (recursive) {
-        for (size_t i = 0; i < count; ++i) {
-            if (S_ISDIR(arr[i].st.st_mode)) {
-                /* skip . and .. if they ever show up (we skip hidden files but be safe) */
-                if (strcmp(arr[i].name, ".") == 0 || strcmp(arr[i].name, "..") == 0)
-                    continue;
-                /* build full path */
-                char child_path[PATH_MAX];
-                join_path(path, arr[i].name, child_path, sizeof(child_path));
-                /* blank line before each sub-directory listing to match `ls -R` style */
-                printf("\n");
-                list_dir(child_path, mode, recursive);
-            }
-        }
+        print_dir(dir, ents, count);
+    return 0;
+}
+
+#ifndef LS_NO_STATS
+static void stats_rate(const char *what, int hit, int miss) {
+    unsigned long long h = atomic_load_explicit(&ls_stats.ctr[hit], memory_order_relaxed);
+    unsigned long long m = atomic_load_explicit(&ls_stats.ctr[miss], memory_order_relaxed);
+    if (h + m == 0)
+        fprintf(stderr, "  %-18s -\n", what);
+    else
+        fprintf(stderr, "  %-18s %5.1f%%  (%llu hits, %llu misses)\n",
+                what, 100.0 * (double)h / (double)(h + m), h, m);
+}
+
+/* Printed to stderr after the listing has been flushed. */
+static void stats_report(void) {
+    static const char *const phase_names[PH_COUNT] = {
+        [PH_READ]          = "read_dir_entries",
+        [PH_STAT]          = "  stat",
+        [PH_READLINK]      = "  readlink",
+        [PH_SORT]          = "sort",
+        [PH_PRINT_LONG]    = "print_long_listing",
+        [PH_PRINT_COLUMNS] = "print_columns",
+        [PH_PRINT_ACROSS]  = "print_horizontal",
+        [PH_PRINT_LINES]   = "print_one_per_line",
+        [PH_PRINT_RECORDS] = "print_records",
+        [PH_NSS]           = "  getpwuid/getgrgid",
+        [PH_WRITE]         = "  write",
+    };
+    unsigned long long c[CTR_COUNT], sys = 0;
+    for (int i = 0; i < CTR_COUNT; i++)
+        c[i] = atomic_load_explicit(&ls_stats.ctr[i], memory_order_relaxed);
+    for (int i = CTR_SYS_OPEN; i <= CTR_SYS_WRITE; i++) sys += c[i];
+
+    fprintf(stderr, "--stats: %.3f ms wall\n", (double)(stats_clock() - ls_stats.start) / 1e6);
+    fprintf(stderr, "  %-20s %10s %12s\n", "phase", "calls", "ms");
+    for (int ph = 0; ph < PH_COUNT; ph++) {
+        unsigned long long calls = atomic_load_explicit(&ls_stats.calls[ph], memory_order_relaxed);
+        if (calls == 0) continue;
+        fprintf(stderr, "  %-20s %10llu %12.3f\n", phase_names[ph], calls,
+                (double)atomic_load_explicit(&ls_stats.ns[ph], memory_order_relaxed) / 1e6);
     }
+    fprintf(stderr, "  directories        %llu\n", c[CTR_DIRS]);
+    fprintf(stderr, "  entries            %llu\n", c[CTR_ENTRIES]);
+    fprintf(stderr, "  max depth          %d\n", ls_stats.max_depth);
+    fprintf(stderr, "  bytes written      %llu\n", c[CTR_BYTES]);
+    fprintf(stderr, "  syscalls           %llu  (open %llu, getdents64 %llu, stat %llu, "
+            "readlink %llu, io_uring_enter %llu, write %llu)\n",
+            sys, c[CTR_SYS_OPEN], c[CTR_SYS_GETDENTS], c[CTR_SYS_STAT],
+            c[CTR_SYS_READLINK], c[CTR_SYS_URING], c[CTR_SYS_WRITE]);
+    stats_rate("uid cache", CTR_UID_HIT, CTR_UID_MISS);
+    stats_rate("gid cache", CTR_GID_HIT, CTR_GID_MISS);
+    stats_rate("time cache", CTR_TIME_HIT, CTR_TIME_MISS);
+    if (opts.cache) stats_rate("directory cache", CTR_DCACHE_HIT, CTR_DCACHE_MISS);
+}
+#endif
 
-    /* free memory */
-    for (size_t i = 0; i < count; i++)
-        free(arr[i].name);
-    free(arr);
+/* ---------- Option helpers ---------- */
+/* Parses a byte count with an optional K/M/G suffix; returns 0 on error. */
+static size_t parse_size(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || end == arg) return 0;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': v <<= 10; end++; break;
+    case 'M': v <<= 20; end++; break;
+    case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0') return 0;
+    return (size_t)v;
 }
 
 /* ---------- MAIN ---------- */
 int main(int argc, char *argv[]) {
     int opt;
-    int mode = 0;       /* 0=default, 1=-l, 2=-x */
-    int recursive = 0;  /* -R */
+    int mode = -1;      /* 0=-C, 1=-l, 2=-x, 3=-1; -1 = pick from the tty */
+    ls_options_t *lo = &opts.list;
+
+    tzset();
 
-    while ((opt = getopt(argc, argv, "lxR")) != -1) {
+    enum { OPT_DONT_SYNC = 256, OPT_DIRBUF, OPT_STAT_JOBS, OPT_IO_URING, OPT_URING_DEPTH,
+           OPT_HEAD, OPT_FORMAT, OPT_STATS, OPT_CACHE, OPT_SINCE, OPT_ONE_FS };
+    static const struct option long_opts[] = {
+        { "dont-sync", no_argument,       NULL, OPT_DONT_SYNC },
+        { "dirbuf",    required_argument, NULL, OPT_DIRBUF },
+        { "stat-jobs", required_argument, NULL, OPT_STAT_JOBS },
+        { "io-uring",  no_argument,       NULL, OPT_IO_URING },
+        { "uring-depth", required_argument, NULL, OPT_URING_DEPTH },
+        { "head",      required_argument, NULL, OPT_HEAD },
+        { "top",       required_argument, NULL, OPT_HEAD },
+        { "format",    required_argument, NULL, OPT_FORMAT },
+        { "stats",     no_argument,       NULL, OPT_STATS },
+        { "cache",     required_argument, NULL, OPT_CACHE },
+        { "since",     required_argument, NULL, OPT_SINCE },
+        { "one-file-system", no_argument, NULL, OPT_ONE_FS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "lxC1RLj:UftSXr", long_opts, NULL)) != -1) {
         switch (opt) {
+        case 't': lo->sort = LS_SORT_TIME; break;
+        case 'S': lo->sort = LS_SORT_SIZE; break;
+        case 'X': lo->sort = LS_SORT_EXT; break;
+        case 'r': lo->reverse = 1; break;
+        case 'U': opts.unsorted = 1; break;
+        case 'f': opts.unsorted = 1; lo->all = 1; break;
         case 'l': mode = 1; break;
         case 'x': mode = 2; break;
-        case 'R': recursive = 1; break;
+        case 'C': mode = 0; break;
+        case '1': mode = 3; break;
+        case 'R': lo->recursive = 1; break;
+        case 'L': lo->follow = 1; break;
+        case 'j':
+            lo->jobs = atoi(optarg);
+            if (lo->jobs < 1 || lo->jobs > 256) {
+                fprintf(stderr, "%s: invalid -j value '%s' (1..256)\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_DONT_SYNC: lo->dont_sync = 1; break;
+        case OPT_DIRBUF:
+            lo->dirbuf_size = parse_size(optarg);
+            if (lo->dirbuf_size < 4096 || lo->dirbuf_size > (1UL << 30)) {
+                fprintf(stderr, "%s: invalid --dirbuf size '%s' (4K..1G)\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_STAT_JOBS:
+            lo->stat_jobs = atoi(optarg);
+            if (lo->stat_jobs < 1 || lo->stat_jobs > 256) {
+                fprintf(stderr, "%s: invalid --stat-jobs value '%s' (1..256)\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_IO_URING: lo->io_uring = 1; break;
+        case OPT_URING_DEPTH:
+            lo->uring_depth = atoi(optarg);
+            if (lo->uring_depth < 1 || lo->uring_depth > 4096) {
+                fprintf(stderr, "%s: invalid --uring-depth value '%s' (1..4096)\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_HEAD: {
+            char *end;
+            errno = 0;
+            unsigned long long k = strtoull(optarg, &end, 10);
+            if (errno || end == optarg || *end || k < 1 || k > (1ULL << 24)) {
+                fprintf(stderr, "%s: invalid --head value '%s' (1..16777216)\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            lo->head = (size_t)k;
+            break;
+        }
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0)
+                opts.format = FMT_TEXT;
+            else if (strcmp(optarg, "ndjson") == 0)
+                opts.format = FMT_NDJSON;
+            else if (strcmp(optarg, "binary") == 0)
+                opts.format = FMT_BINARY;
+            else {
+                fprintf(stderr, "%s: invalid --format '%s' (text, ndjson, binary)\n",
+                        argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_CACHE: opts.cache = optarg; break;
+        case OPT_SINCE: opts.since = optarg; break;
+        case OPT_ONE_FS: lo->one_file_system = 1; break;
+        case OPT_STATS:
+#ifdef LS_NO_STATS
+            fprintf(stderr, "%s: --stats is not built in (this build used STATS=0)\n", argv[0]);
+            exit(EXIT_FAILURE);
+#else
+            opts.stats = 1;
+            ls_stats.enabled = 1;
+            ls_stats.start = stats_clock();
+            break;
+#endif
         default:
-            fprintf(stderr, "Usage: %s [-l] [-x] [-R] [paths...]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-l] [-x] [-C] [-1] [-R] [-L] [-t] [-S] [-X] [-r] [-U] [-f] [-j N]\n"
+                    "          [--dont-sync] [--dirbuf=SIZE] [--stat-jobs=N]\n"
+                    "          [--io-uring] [--uring-depth=N] [--head=K]\n"
+                    "          [--format=text|ndjson|binary] [--stats] [--cache=FILE]\n"
+                    "          [--since=SNAPSHOT] [--one-file-system] [paths...]\n",
+                    argv[0]);
             exit(EXIT_FAILURE);
         }
     }
 
-    /* If user provided paths, list each; otherwise list current directory */
-    if (optind < argc) {
-        for (int i = optind; i < argc; ++i) {
-            if (i > optind) printf("\n");
-            list_dir(argv[i], mode, recursive);
-        }
-    } else {
-        list_dir(".", mode, recursive);
+    /* Ask about the terminal once: a pipe or file gets one plain name per
+     * line unless -l/-x/-C says otherwise, and never any color escapes. */
+    if (isatty(STDOUT_FILENO)) {
+        struct winsize ws;
+        lo->color = 1;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+            opts.term_width = ws.ws_col;
+        if (mode == -1) mode = 0;
+        ls_colors_load(getenv("LS_COLORS"));
+    } else if (mode == -1) {
+        mode = 3;
     }
+    /* records carry the full stat, so load directories as -l does */
+    if (opts.format != FMT_TEXT) mode = 1;
+    opts.mode = mode;
+    lo->fields = (mode == 1) ? LS_FIELD_STAT : LS_FIELD_TYPE;
+    if (opts.format != FMT_TEXT) lo->fields |= LS_FIELD_ALLSTAT;
+    if (opts.unsorted) lo->sort = LS_SORT_NONE;
+    lo->on_error = report_error;
 
-    return 0;
+    /* -U and --head never keep a full sorted listing to cache */
+    if ((opts.since || opts.cache) && (opts.unsorted || lo->head)) {
+        fprintf(stderr, "%s: %s cannot be combined with -U, -f or --head\n",
+                argv[0], opts.since ? "--since" : "--cache");
+        exit(EXIT_FAILURE);
+    }
+    if (opts.since)
+        ls_cache_open(opts.since, opts.cache, 1);  /* --cache=FILE: next snapshot */
+    else if (opts.cache)
+        ls_cache_open(opts.cache, opts.cache, 0);
+
+    /* If user provided paths, list each; otherwise list current directory */
+    static const char *const dot[] = { "." };
+    const char *const *paths = optind < argc ? (const char *const *)argv + optind : dot;
+    size_t npaths = optind < argc ? (size_t)(argc - optind) : 1;
+
+    ls_walk_ops_t ops = { enter_dir, list_entries, NULL };
+    ls_walk(paths, npaths, lo, &ops);
+
+    out_flush();
+    ls_cache_close();
+#ifndef LS_NO_STATS
+    if (opts.stats) stats_report();
+#endif
+    id_cache_free(&user_cache);
+    id_cache_free(&group_cache);
+    ls_colors_free();
+    return out.failed || listing_errors ? EXIT_FAILURE : 0;
 }
+
@@ -0,0 +1,90 @@
+/* ---------- Run statistics (--stats) ----------
+ * Phase timings from CLOCK_MONOTONIC and event counters, reported on
+ * stderr at exit. Times are summed over all threads, and phases nest:
+ * read_dir_entries includes stat and readlink, the printers include
+ * NSS lookups and write. Syscalls are counted where we issue them;
+ * readdir()'s own getdents64 calls and NSS internals are not visible.
+ *
+ * Shared by libls and the ls front end (not part of the library's API).
+ * Every hook is a single branch on ls_stats.enabled; `make STATS=0`
+ * defines LS_NO_STATS and compiles them out altogether.
+ */
+#ifndef LS_STATS_H
+#define LS_STATS_H
+
+#include <stdatomic.h>
+#include <time.h>
+
+enum {
+    PH_READ, PH_STAT, PH_READLINK, PH_SORT, PH_PRINT_LONG, PH_PRINT_COLUMNS,
+    PH_PRINT_ACROSS, PH_PRINT_LINES, PH_PRINT_RECORDS, PH_NSS, PH_WRITE,
+    PH_COUNT
+};
+
+enum {
+    CTR_DIRS, CTR_ENTRIES, CTR_BYTES,
+    CTR_SYS_OPEN, CTR_SYS_GETDENTS, CTR_SYS_STAT, CTR_SYS_READLINK,
+    CTR_SYS_URING, CTR_SYS_WRITE,
+    CTR_UID_HIT, CTR_UID_MISS, CTR_GID_HIT, CTR_GID_MISS,
+    CTR_TIME_HIT, CTR_TIME_MISS,
+    CTR_DCACHE_HIT, CTR_DCACHE_MISS,
+    CTR_COUNT
+};
+
+#ifndef LS_NO_STATS
+struct ls_stats {
+    int enabled;
+    atomic_ullong ns[PH_COUNT];
+    atomic_ullong calls[PH_COUNT];
+    atomic_ullong ctr[CTR_COUNT];
+    int depth, max_depth;           /* printer thread only */
+    unsigned long long start;
+};
+
+extern struct ls_stats ls_stats;
+
+static inline unsigned long long stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static inline unsigned long long stats_now(void) {
+    return ls_stats.enabled ? stats_clock() : 0;
+}
+
+static inline void stats_phase(int ph, unsigned long long t0) {
+    if (!ls_stats.enabled) return;
+    atomic_fetch_add_explicit(&ls_stats.ns[ph], stats_clock() - t0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ls_stats.calls[ph], 1, memory_order_relaxed);
+}
+
+static inline void stats_count(int c, unsigned long long n) {
+    if (ls_stats.enabled) atomic_fetch_add_explicit(&ls_stats.ctr[c], n, memory_order_relaxed);
+}
+
+static inline void stats_enter_dir(void) {
+    if (ls_stats.enabled && ++ls_stats.depth > ls_stats.max_depth)
+        ls_stats.max_depth = ls_stats.depth;
+}
+
+static inline void stats_leave_dir(void) {
+    if (ls_stats.enabled) ls_stats.depth--;
+}
+
+#define STATS_START(t)      unsigned long long t = stats_now()
+#define STATS_RESTART(t)    ((t) = stats_now())
+#define STATS_STOP(ph, t)   stats_phase(ph, t)
+#define STATS_COUNT(c, n)   stats_count(c, n)
+#define STATS_ENTER_DIR()   stats_enter_dir()
+#define STATS_LEAVE_DIR()   stats_leave_dir()
+#else
+#define STATS_START(t)      ((void)0)
+#define STATS_RESTART(t)    ((void)0)
+#define STATS_STOP(ph, t)   ((void)0)
+#define STATS_COUNT(c, n)   ((void)0)
+#define STATS_ENTER_DIR()   ((void)0)
+#define STATS_LEAVE_DIR()   ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+#!/bin/sh
+# Regression checks for bin/ls: make check (or tools/check.sh BIN).
+# Each check builds its fixture under a scratch directory and fails with
+# a message naming the case.
+LS=${1:-bin/ls}
+case $LS in /*) ;; *) LS=$(pwd)/$LS ;; esac
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/ls-check.XXXXXX") || exit 1
+trap 'rm -rf "$TMP"' EXIT
+fails=0
+
+fail() {
+    echo "FAIL: $*"
+    fails=$((fails + 1))
+}
+
+# --cache/--since with empty, truncated and corrupt snapshot files:
+# nothing is reused, nothing crashes, the listing is the plain one.
+mkdir -p "$TMP/tree/sub" && : > "$TMP/tree/file"
+want=$(cd "$TMP/tree" && "$LS" .)
+"$LS" --cache="$TMP/good.db" "$TMP/tree" > /dev/null
+: > "$TMP/empty.db"
+head -c 16 "$TMP/good.db" > "$TMP/header.db"
+{ head -c 16 "$TMP/good.db"; head -c 200 /dev/zero; } > "$TMP/zeros.db"
+{ head -c 16 "$TMP/good.db"; head -c 200 /dev/urandom; } > "$TMP/random.db"
+head -c 40 /dev/urandom > "$TMP/garbage.db"
+for db in empty header zeros random garbage; do
+    cp "$TMP/$db.db" "$TMP/use.db"
+    got=$(cd "$TMP/tree" && "$LS" --cache="$TMP/use.db" .) || fail "--cache with $db snapshot exits $?"
+    [ "$got" = "$want" ] || fail "--cache with $db snapshot lists differently"
+    cp "$TMP/$db.db" "$TMP/use.db"
+    (cd "$TMP/tree" && "$LS" --since="$TMP/use.db" . > /dev/null) ||
+        fail "--since with $db snapshot exits $?"
+done
+
+# -U, -f and --head keep no full listing, so --cache and --since refuse
+# them rather than leave the snapshot unwritten.
+for opt in -U -f --head=1; do
+    "$LS" $opt --cache="$TMP/refused.db" "$TMP/tree" > /dev/null 2>&1 &&
+        fail "--cache with $opt exits 0"
+    [ -e "$TMP/refused.db" ] && fail "--cache with $opt wrote a snapshot"
+    "$LS" $opt --since="$TMP/good.db" "$TMP/tree" > /dev/null 2>&1 &&
+        fail "--since with $opt exits 0"
+done
+
+# A second --cache run reuses every directory and lists the same; once a
+# directory changes, its listing is read afresh. Directories changed in
+# the last DCACHE_RACY_SECS are never stored, hence the sleep.
+mkdir -p "$TMP/ct/s" "$TMP/ct/t" && : > "$TMP/ct/a" && : > "$TMP/ct/s/b" && : > "$TMP/ct/t/c"
+sleep 3
+want=$("$LS" -R -l "$TMP/ct")
+"$LS" -R -l --cache="$TMP/ct.db" "$TMP/ct" > /dev/null
+got=$("$LS" -R -l --cache="$TMP/ct.db" "$TMP/ct") || fail "--cache reuse exits $?"
+[ "$got" = "$want" ] || fail "--cache reuse lists differently"
+if "$LS" --stats "$TMP/ct" > /dev/null 2>&1; then
+    hits=$("$LS" -R -l --cache="$TMP/ct.db" --stats "$TMP/ct" 2>&1 > /dev/null |
+        sed -n 's/.*directory cache.*(\([0-9]*\) hits.*/\1/p')
+    [ "$hits" = 3 ] || fail "--cache reuse: ${hits:-no} hits, want 3"
+fi
+cp "$TMP/ct.db" "$TMP/ct-before.db"
+: > "$TMP/ct/s/new"
+got=$("$LS" -R -l --cache="$TMP/ct.db" "$TMP/ct")
+[ "$got" = "$("$LS" -R -l "$TMP/ct")" ] || fail "--cache lists a changed directory from the snapshot"
+
+# --since lists only the directory changed after the snapshot was taken
+got=$("$LS" -R -l --since="$TMP/ct-before.db" "$TMP/ct" | grep ':$')
+[ "$got" = "$TMP/ct/s:" ] || fail "--since lists: $got"
+
+# -R -j on a tree deeper than the descriptor limit lists all of it, the
+# same as the serial walk.
+d="$TMP/deep" i=0
+while [ $i -lt 200 ]; do d=$d/d; i=$((i + 1)); done
+mkdir -p "$d"
+want=$("$LS" -R "$TMP/deep")
+got=$(ulimit -n 32 && "$LS" -R -j4 "$TMP/deep") || fail "-R -j4 under ulimit -n 32 exits $?"
+[ "$got" = "$want" ] || fail "-R -j4 under ulimit -n 32 lists differently"
+
+# -R -j lists a branching tree exactly as the serial walk does, in each
+# sort order and with -U, -l, --head and -L.
+for a in 0 1 2 3 4 5; do
+    for b in 0 1 2 3 4 5; do
+        for c in 0 1 2 3; do mkdir -p "$TMP/wide/d$a/e$b/f$c" && : > "$TMP/wide/d$a/e$b/f$c/x"; done
+    done
+    ln -s ../d0 "$TMP/wide/d$a/up"
+done
+for c in "" -l -t "-S -r" -X -U --head=2 -L; do
+    want=$("$LS" -R $c "$TMP/wide" 2> /dev/null)
+    got=$("$LS" -R -j4 $c "$TMP/wide" 2> /dev/null)
+    [ "$got" = "$want" ] || fail "-R -j4 $c lists differently from -R $c"
+done
+
+# Several paths are read concurrently but print in command-line order,
+# each as it lists on its own, and a path that fails does not stop the rest.
+set -- "$TMP/wide/d0/e0" "$TMP/wide/d1" "$TMP/wide/d2/e1" "$TMP/wide/d3"
+want=$(sep=; for p; do [ -n "$sep" ] && echo; sep=1; "$LS" -l "$p"; done)
+got=$("$LS" -l "$@")
+[ "$got" = "$want" ] || fail "several paths list differently from one at a time"
+set -- "$@" "$TMP/missing" "$TMP/wide/d4"
+want=$("$LS" -R "$@" 2> /dev/null)
+got=$("$LS" -R -j4 "$@" 2> /dev/null)
+[ "$got" = "$want" ] || fail "-R -j4 with several paths lists differently from -R"
+
+# --format=ndjson stays valid JSON for names that are not UTF-8, and
+# "name_bytes" names decode back to the bytes on disk.
+if command -v python3 > /dev/null; then
+    mkdir "$TMP/names" && : > "$TMP/names/$(printf 'a\351b')" && : > "$TMP/names/ok"
+    "$LS" --format=ndjson "$TMP/names" | python3 -c '
+import json, os, sys
+for line in sys.stdin.buffer:
+    o = json.loads(line)
+    name = o["name"].encode("latin-1" if o.get("name_bytes") else "utf-8")
+    os.lstat(os.path.join(o["dir"].encode(), name))
+' || fail "--format=ndjson with a non-UTF-8 name"
+fi
+
+# --format=ndjson and --format=binary carry lstat()'s fields for every
+# entry of a -R walk, symlink targets included, and agree with each
+# other; -j gives the same stream.
+if command -v python3 > /dev/null; then
+    mkdir -p "$TMP/rec/sub" && head -c 123 /dev/zero > "$TMP/rec/file" &&
+        ln -s file "$TMP/rec/link" && : > "$TMP/rec/sub/inner"
+    "$LS" -R --format=ndjson "$TMP/rec" > "$TMP/rec.ndjson"
+    "$LS" -R --format=binary "$TMP/rec" > "$TMP/rec.bin"
+    "$LS" -R -j4 --format=binary "$TMP/rec" | cmp -s - "$TMP/rec.bin" ||
+        fail "--format=binary -R -j4 differs from -R"
+    python3 - "$TMP/rec" "$TMP/rec.ndjson" "$TMP/rec.bin" <<'PY' || fail "--format records"
+import json, os, struct, sys
+root, nd, bn = sys.argv[1:]
+fields = ("ino", "dev", "nlink", "size", "blocks", "mode", "uid", "gid", "mtime", "mtime_nsec")
+
+def want(d, name):
+    st = os.lstat(os.path.join(d, name))
+    r = dict(zip(fields, (st.st_ino, st.st_dev, st.st_nlink, st.st_size, st.st_blocks,
+                          st.st_mode, st.st_uid, st.st_gid, st.st_mtime_ns // 10**9,
+                          st.st_mtime_ns % 10**9)))
+    r["dir"], r["name"] = d, name
+    if os.path.islink(os.path.join(d, name)):
+        r["target"] = os.readlink(os.path.join(d, name))
+    return r
+
+key = lambda r: (r["dir"], r["name"])
+expect = sorted((want(d, n) for d, ds, fs in os.walk(root) for n in ds + fs), key=key)
+
+with open(nd) as f:
+    got_nd = [json.loads(line) for line in f]
+
+got_bn, d = [], None
+data = open(bn, "rb").read()
+i = 0
+while i < len(data):
+    n, kind = struct.unpack_from("=IB", data, i)
+    body = data[i + 5:i + 4 + n]
+    i += 4 + n
+    if kind == ord("D"):
+        d = body.decode()
+        continue
+    v = struct.unpack_from("=5Q3Iq3I", body)
+    r = dict(zip(fields, v[:10]))
+    name_len, target_len = v[10:]
+    off = struct.calcsize("=5Q3Iq3I")
+    r["dir"], r["name"] = d, body[off:off + name_len].decode()
+    if target_len:
+        r["target"] = body[off + name_len:off + name_len + target_len].decode()
+    got_bn.append(r)
+
+for what, got in (("ndjson", got_nd), ("binary", got_bn)):
+    if sorted(got, key=key) != expect:
+        sys.exit("--format=%s: %r" % (what, got))
+if got_nd != got_bn:
+    sys.exit("ndjson and binary list differently")
+PY
+fi
+
+# -X: no extension, then an empty one ("foo."), then the rest
+mkdir "$TMP/ext" && (cd "$TMP/ext" && : > foo.c && : > foo. && : > foo && : > bar.)
+got=$("$LS" -X -1 "$TMP/ext" | tr '\n' ' ')
+[ "$got" = "foo bar. foo. foo.c " ] || fail "-X order: $got"
+
+# -t newest first, -S largest first, -r reverses either
+mkdir "$TMP/ord" && (cd "$TMP/ord" &&
+    head -c 300 /dev/zero > a && head -c 10 /dev/zero > b && head -c 20 /dev/zero > c &&
+    touch -t 200101010000 a && touch -t 200301010000 b && touch -t 200201010000 c)
+for c in "-1:a b c" "-r:c b a" "-t:b c a" "-t -r:a c b" "-S:a c b" "-S -r:b c a"; do
+    got=$("$LS" -1 ${c%%:*} "$TMP/ord" | tr '\n' ' ')
+    [ "$got" = "${c#*:} " ] || fail "${c%%:*} order: $got"
+done
+
+# --head=K is the first K lines of the full listing, in every order and
+# across directories larger than one read batch. Under -R it descends
+# only into the subdirectories it shows.
+mkdir "$TMP/many" && (cd "$TMP/many" && i=0 &&
+    while [ $i -lt 3000 ]; do : > f$i; i=$((i + 1)); done)
+for c in "" -r; do
+    want=$("$LS" -1 $c "$TMP/many" | head -n 7)
+    got=$("$LS" -1 $c --head=7 "$TMP/many")
+    [ "$got" = "$want" ] || fail "--head=7 $c lists differently from | head"
+done
+for c in -t -S; do
+    want=$("$LS" -1 $c "$TMP/ord" | head -n 2)
+    got=$("$LS" -1 $c --top=2 "$TMP/ord")
+    [ "$got" = "$want" ] || fail "--top=2 $c lists differently from | head"
+done
+mkdir -p "$TMP/hr/a/x" "$TMP/hr/b/y"
+got=$("$LS" -R -1 --head=1 "$TMP/hr" | tr '\n' ' ')
+[ "$got" = "$TMP/hr: a  $TMP/hr/a: x  $TMP/hr/a/x: " ] || fail "-R --head=1: $got"
+
+# anything left out is an error exit
+"$LS" "$TMP/missing" 2> /dev/null && fail "missing path exits 0"
+
+if [ $fails -eq 0 ]; then
+    echo "all checks passed"
+else
+    echo "$fails check(s) failed"
+    exit 1
+fi
@@ -0,0 +1,397 @@
+/*
+ * lsbench - synthetic trees and timings for bin/ls
+ *
+ *   lsbench [-n reps] [-m modes] <ls-binary> <bench-dir> <tree>...
+ *
+ * Each named tree is generated under bench-dir on first use (the same
+ * seed always gives the same names, sizes and mtimes) and then listed
+ * once per mode. A mode is a set of ls options ("-l", "-R -j4"), and
+ * "default" means none. Every run lists "." from inside the tree, with
+ * stdout and stderr on /dev/null.
+ *
+ * Reported per run: best-of-reps wall time with its user/sys time,
+ * peak RSS, and the syscall count of one extra run traced with ptrace
+ * (threads included). One untimed run first warms the dentry cache.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_MODES 32
+#define MAX_ARGS  16
+
+/* ---------- Reproducible randomness ---------- */
+static uint64_t rng_next(uint64_t *s) {
+    /* xorshift64* */
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t rng_range(uint64_t *s, size_t lo, size_t hi) {
+    return lo + (size_t)(rng_next(s) % (hi - lo + 1));
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* ---------- Tree generation ---------- */
+static const char *const exts[] = {
+    "", "", "", ".c", ".h", ".txt", ".md", ".o", ".tar", ".gz", ".zip", ".sh"
+};
+
+/* A unique name: random letters of length len, then the index and a
+ * random extension. Index keeps names unique without a lookup table. */
+static void make_name(char *buf, uint64_t *rng, size_t len, size_t idx) {
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    char tail[32];
+    int tlen = snprintf(tail, sizeof(tail), "%zx%s", idx,
+                        exts[rng_next(rng) % (sizeof(exts) / sizeof(exts[0]))]);
+    if (len + (size_t)tlen > NAME_MAX) len = NAME_MAX - (size_t)tlen;
+    for (size_t i = 0; i < len; i++)
+        buf[i] = alpha[rng_next(rng) % (sizeof(alpha) - 1)];
+    memcpy(buf + len, tail, (size_t)tlen + 1);
+}
+
+/* Empty file with a random sparse size and a random mtime in the past
+ * few years, so -S and -t have something to sort. */
+static void make_file(int dfd, const char *name, uint64_t *rng) {
+    int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) die(name);
+    off_t size = (off_t)(rng_next(rng) % (1u << 20));
+    if ((rng_next(rng) & 7) == 0 && ftruncate(fd, size) < 0) die("ftruncate");
+    struct timespec ts[2];
+    ts[0].tv_sec = ts[1].tv_sec = 1500000000 + (time_t)(rng_next(rng) % 200000000);
+    ts[0].tv_nsec = ts[1].tv_nsec = (long)(rng_next(rng) % 1000000000);
+    if (futimens(fd, ts) < 0) die("futimens");
+    if ((rng_next(rng) & 15) == 0) fchmod(fd, 0755);
+    close(fd);
+}
+
+static int make_subdir(int dfd, const char *name) {
+    if (mkdirat(dfd, name, 0755) < 0) die(name);
+    int fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) die(name);
+    return fd;
+}
+
+static void gen_files(int dfd, uint64_t *rng, size_t n, size_t min_len, size_t max_len) {
+    char name[NAME_MAX + 1];
+    for (size_t i = 0; i < n; i++) {
+        make_name(name, rng, rng_range(rng, min_len, max_len), i);
+        make_file(dfd, name, rng);
+    }
+}
+
+static void gen_flat(int dfd, uint64_t *rng, size_t n) {
+    gen_files(dfd, rng, n, 4, 24);
+}
+
+/* A chain of n directories, 8 files at every level. */
+static void gen_deep(int dfd, uint64_t *rng, size_t n) {
+    int fd = dup(dfd);
+    for (size_t level = 0; level < n; level++) {
+        gen_files(fd, rng, 8, 4, 12);
+        int sub = make_subdir(fd, "d");
+        close(fd);
+        fd = sub;
+    }
+    close(fd);
+}
+
+/* Fan-out 8, n levels deep, 16 files per directory. */
+static void gen_wide(int dfd, uint64_t *rng, size_t n) {
+    gen_files(dfd, rng, 16, 4, 16);
+    if (n == 0) return;
+    for (int i = 0; i < 8; i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "w%d", i);
+        int sub = make_subdir(dfd, name);
+        gen_wide(sub, rng, n - 1);
+        close(sub);
+    }
+}
+
+/* n entries: one in ten a file, one in forty a directory, the rest
+ * symlinks to files, to directories, dangling, or to other links. */
+static void gen_symlinks(int dfd, uint64_t *rng, size_t n) {
+    char name[NAME_MAX + 1], target[NAME_MAX + 16];
+    size_t nfiles = n / 10, ndirs = n / 40;
+    for (size_t i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        make_file(dfd, name, rng);
+    }
+    for (size_t i = 0; i < ndirs; i++) {
+        snprintf(name, sizeof(name), "d%zu", i);
+        close(make_subdir(dfd, name));
+    }
+    for (size_t i = 0; i < n - nfiles - ndirs; i++) {
+        switch (rng_next(rng) % 4) {
+        case 0: snprintf(target, sizeof(target), "f%zu", rng_range(rng, 0, nfiles - 1)); break;
+        case 1: snprintf(target, sizeof(target), "d%zu", rng_range(rng, 0, ndirs - 1)); break;
+        case 2: snprintf(target, sizeof(target), "missing/%zu", i); break;
+        default: snprintf(target, sizeof(target), "l%zu", i ? rng_range(rng, 0, i - 1) : 0); break;
+        }
+        snprintf(name, sizeof(name), "l%zu", i);
+        if (symlinkat(target, dfd, name) < 0) die(name);
+    }
+}
+
+/* Half short names, a third medium, the rest up to NAME_MAX. */
+static void gen_longnames(int dfd, uint64_t *rng, size_t n) {
+    char name[NAME_MAX + 1];
+    for (size_t i = 0; i < n; i++) {
+        size_t r = rng_next(rng) % 6, len;
+        if (r < 3)      len = rng_range(rng, 1, 16);
+        else if (r < 5) len = rng_range(rng, 17, 64);
+        else            len = rng_range(rng, 65, NAME_MAX);
+        make_name(name, rng, len, i);
+        make_file(dfd, name, rng);
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*gen)(int dfd, uint64_t *rng, size_t n);
+    size_t n;
+} tree_spec_t;
+
+static const tree_spec_t trees[] = {
+    { "flat10k",   gen_flat,      10000 },
+    { "flat1m",    gen_flat,      1000000 },
+    { "flat10m",   gen_flat,      10000000 },
+    { "deep",      gen_deep,      256 },
+    { "wide",      gen_wide,      4 },
+    { "symlinks",  gen_symlinks,  10000 },
+    { "longnames", gen_longnames, 10000 },
+};
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+/* Builds bench-dir/<name> unless its stamp says a previous run finished
+ * it; a half-built tree from an interrupted run is removed first. */
+static void ensure_tree(const char *bench_dir, const tree_spec_t *t) {
+    char path[PATH_MAX], stamp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", bench_dir, t->name);
+    snprintf(stamp, sizeof(stamp), "%s/.%s.done", bench_dir, t->name);
+    if (access(stamp, F_OK) == 0) return;
+
+    if (access(path, F_OK) == 0 && nftw(path, rm_entry, 64, FTW_DEPTH | FTW_PHYS) < 0)
+        die(path);
+    fprintf(stderr, "lsbench: generating %s\n", path);
+    if (mkdir(path, 0755) < 0) die(path);
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) die(path);
+
+    uint64_t rng = 0x9E3779B97F4A7C15ULL ^ t->n;
+    for (const char *p = t->name; *p; p++) rng = rng * 31 + (unsigned char)*p;
+    t->gen(dfd, &rng, t->n);
+    close(dfd);
+
+    int fd = open(stamp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) die(stamp);
+    close(fd);
+}
+
+/* ---------- Running ls ---------- */
+typedef struct {
+    double wall_ms, user_ms, sys_ms;
+    long maxrss_kb;
+} run_stats_t;
+
+static double tv_ms(struct timeval tv) {
+    return (double)tv.tv_sec * 1e3 + (double)tv.tv_usec / 1e3;
+}
+
+static void child_exec(const char *dir, char **argv, int traced) {
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0 || chdir(dir) < 0) _exit(127);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    if (traced) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) _exit(126);
+        raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+static int run_once(const char *dir, char **argv, run_stats_t *rs) {
+    struct timespec t0, t1;
+    struct rusage ru;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) child_exec(dir, argv, 0);
+    if (wait4(pid, &status, 0, &ru) < 0) die("wait4");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    rs->wall_ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 +
+                  (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    rs->user_ms = tv_ms(ru.ru_utime);
+    rs->sys_ms = tv_ms(ru.ru_stime);
+    rs->maxrss_kb = ru.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Counts syscall entries of ls and all of its threads; -1 if ptrace is
+ * not permitted here (some containers). */
+static long count_syscalls(const char *dir, char **argv) {
+    int status;
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) child_exec(dir, argv, 1);
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                              PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    long entries = 0, stops = 0;
+    int have_info = 1;
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) break;                 /* ECHILD: everything exited */
+        if (!WIFSTOPPED(status)) continue;
+
+        int sig = WSTOPSIG(status), inject = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;   /* glibc spelling */
+            stops++;
+            if (have_info &&
+                ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info), &info) > 0) {
+                if (info.op == PTRACE_SYSCALL_INFO_ENTRY) entries++;
+            } else {
+                have_info = 0;
+            }
+        } else if (status >> 16 == 0 && sig != SIGSTOP) {
+            inject = sig;                   /* a real signal: pass it on */
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)inject);
+    }
+    return have_info ? entries : stops / 2;
+}
+
+/* Splits "-R -j4" into argv after the binary; "default" adds nothing. */
+static char **build_argv(const char *ls, char *mode, char **argv) {
+    int n = 0;
+    argv[n++] = (char *)ls;
+    if (strcmp(mode, "default") != 0) {
+        for (char *tok = strtok(mode, " "); tok && n < MAX_ARGS - 1; tok = strtok(NULL, " "))
+            argv[n++] = tok;
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+static void bench_tree(const char *ls, const char *dir, const char *tree,
+                       char **modes, int nmodes, int reps) {
+    for (int m = 0; m < nmodes; m++) {
+        char mode_buf[256], *argv[MAX_ARGS];
+        snprintf(mode_buf, sizeof(mode_buf), "%s", modes[m]);
+        build_argv(ls, mode_buf, argv);
+
+        run_stats_t best = { -1, 0, 0, 0 }, rs;
+        run_once(dir, argv, &rs);           /* warm-up */
+        int rc = 0;
+        for (int r = 0; r < reps; r++) {
+            rc = run_once(dir, argv, &rs);
+            long rss = rs.maxrss_kb > best.maxrss_kb ? rs.maxrss_kb : best.maxrss_kb;
+            if (best.wall_ms < 0 || rs.wall_ms < best.wall_ms) best = rs;
+            best.maxrss_kb = rss;
+        }
+        long sc = count_syscalls(dir, argv);
+
+        char sc_buf[24];
+        if (sc < 0) snprintf(sc_buf, sizeof(sc_buf), "-");
+        else        snprintf(sc_buf, sizeof(sc_buf), "%ld", sc);
+        printf("%-10s %-12s %10.1f %10.1f %10.1f %10ld %10s%s\n",
+               tree, modes[m], best.wall_ms, best.user_ms, best.sys_ms,
+               best.maxrss_kb, sc_buf, rc ? "  (exit != 0)" : "");
+        fflush(stdout);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n reps] [-m mode,mode,...] <ls-binary> <bench-dir> <tree>...\n"
+            "trees:", prog);
+    for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++)
+        fprintf(stderr, " %s", trees[i].name);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int reps = 3, opt, nmodes = 0;
+    char *modes[MAX_MODES];
+    char default_modes[] = "default,-l,-x,-R";
+    char *mode_list = default_modes;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+        case 'n':
+            reps = atoi(optarg);
+            if (reps < 1) usage(argv[0]);
+            break;
+        case 'm': mode_list = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3) usage(argv[0]);
+
+    for (char *tok = strtok(mode_list, ","); tok && nmodes < MAX_MODES; tok = strtok(NULL, ","))
+        modes[nmodes++] = tok;
+
+    char ls[PATH_MAX];
+    if (!realpath(argv[optind], ls)) die(argv[optind]);
+    const char *bench_dir = argv[optind + 1];
+    if (mkdir(bench_dir, 0755) < 0 && errno != EEXIST) die(bench_dir);
+
+    printf("%-10s %-12s %10s %10s %10s %10s %10s\n",
+           "tree", "mode", "wall_ms", "user_ms", "sys_ms", "maxrss_kb", "syscalls");
+    for (int i = optind + 2; i < argc; i++) {
+        const tree_spec_t *t = NULL;
+        for (size_t k = 0; k < sizeof(trees) / sizeof(trees[0]); k++)
+            if (strcmp(trees[k].name, argv[i]) == 0) t = &trees[k];
+        if (!t) {
+            fprintf(stderr, "%s: unknown tree '%s'\n", argv[0], argv[i]);
+            usage(argv[0]);
+        }
+        ensure_tree(bench_dir, t);
+
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%s", bench_dir, t->name);
+        bench_tree(ls, dir, t->name, modes, nmodes, reps);
+    }
+    return 0;
+}